@@ -30,7 +30,7 @@ dump_mtp_error ()
 #endif
 
 #define enter_lock(a...)       do { DBG("lock"); DBG(a); g_mutex_lock(&device_lock); } while(0)
-#define return_unlock(a)       do { DBG("return unlock"); g_mutex_unlock(&device_lock); return a; } while(0)
+#define return_unlock(a)       do { DBG("return unlock"); publish_snapshot (); g_mutex_unlock(&device_lock); return a; } while(0)
 
 void
 free_files (LIBMTP_file_t * filelist)
@@ -65,67 +65,64 @@ check_files ()
       LIBMTP_file_t *newfiles = NULL;
       if (files)
 	free_files (files);
-      newfiles = LIBMTP_Get_Filelisting_With_Callback (device, NULL, NULL);
+      // Found again when the index is rebuilt
+      g_slist_free (lostfiles);
+      lostfiles = NULL;
+      if (lazy_listing)
+	{
+	  // Folders are listed again as they are visited
+	  int i;
+	  for (i = 0; i < 4; i++)
+	    storageArea[i].listed = FALSE;
+	  if (listed_folders)
+	    g_hash_table_remove_all (listed_folders);
+	}
+      else
+	{
+	  newfiles =
+	    LIBMTP_Get_Filelisting_With_Callback (device, NULL, NULL);
+	}
       files = newfiles;
       newfiles = NULL;
+      forget_file_links ();
       files_changed = FALSE;
-      //check_lost_files ();
+      index_changed = TRUE;
       DBG ("Refreshing Filelist exiting");
     }
 }
 
+/* A file is lost if its parent folder is not on the device.  The object
+ * index doubles as the set of known folder ids. */
+static gboolean
+is_lost_file (LIBMTP_file_t * file)
+{
+  MTPObject *parent;
+  if (file->parent_id == 0)
+    return FALSE;
+  parent = g_hash_table_lookup (object_index,
+				GUINT_TO_POINTER (file->parent_id));
+  return parent == NULL || parent->folder == NULL;
+}
+
+/* Collect the lost files in one pass over the file list, after the index
+ * has been rebuilt */
 static void
 check_lost_files ()
 {
-  int last_parent_id = -1;
-  gboolean last_parent_found = FALSE;
   LIBMTP_file_t *item;
+  int count = 0;
 
-  if (lostfiles != NULL)
-    g_slist_free (lostfiles);
-
+  g_slist_free (lostfiles);
   lostfiles = NULL;
   for (item = files; item != NULL; item = item->next)
     {
-      gboolean parent_found;
-
-      if (last_parent_id == -1 || last_parent_id != item->parent_id)
-	{
-	  if (item->parent_id == 0)
-	    {
-	      parent_found = TRUE;
-	    }
-	  else
-	    {
-	      int i;
-	      for (i = 0; i < 4; i++)
-		{
-		  if (storageArea[i].folders != NULL)
-		    {
-		      if (LIBMTP_Find_Folder
-			  (storageArea[i].folders, item->parent_id) != NULL)
-			{
-			  parent_found = FALSE;
-			}
-		    }
-		}
-	    }
-	  last_parent_id = item->parent_id;
-	  last_parent_found = parent_found;
-	}
-      else
-	{
-	  parent_found = last_parent_found;
-	}
-      DBG ("MTPFS checking for lost files %s, parent %d - %s",
-	   item->filename, last_parent_id, (parent_found ? "FALSE" : "TRUE"));
-      if (parent_found == FALSE)
+      if (is_lost_file (item))
 	{
-	  lostfiles = g_slist_append (lostfiles, item);
+	  lostfiles = g_slist_prepend (lostfiles, item);
+	  count++;
 	}
     }
-  DBG ("MTPFS checking for lost files exit found %d lost tracks",
-       g_slist_length (lostfiles));
+  DBG ("MTPFS checking for lost files exit found %d lost tracks", count);
 }
 
 void
@@ -143,12 +140,22 @@ check_folders ()
 	    {
 	      LIBMTP_destroy_folder_t (storageArea[i].folders);
 	    }
-	  newfolders =
-	    LIBMTP_Get_Folder_List_For_Storage (device,
-						storageArea[i].storage->id);
+	  if (lazy_listing)
+	    {
+	      // Files may have lost their parent folders, start afresh
+	      files_changed = TRUE;
+	    }
+	  else
+	    {
+	      newfolders =
+		LIBMTP_Get_Folder_List_For_Storage (device,
+						    storageArea[i].
+						    storage->id);
+	    }
 	  storageArea[i].folders = newfolders;
 	  newfolders = NULL;
 	  storageArea[i].folders_changed = FALSE;
+	  index_changed = TRUE;
 	}
     }
 }
@@ -165,1177 +172,4619 @@ check_playlists ()
       newplaylists = LIBMTP_Get_Playlist_List (device);
       playlists = newplaylists;
       playlists_changed = FALSE;
+      playlists_version++;
     }
 }
 
-int
-save_playlist (const char *path, struct fuse_file_info *fi)
+static int
+find_storage_by_id (uint32_t storage_id)
 {
-  DBG ("save_playlist");
-  int ret = 0;
-
-  LIBMTP_playlist_t *playlist;
-  FILE *file = NULL;
-  char item_path[1024];
-  uint32_t item_id = 0;
-  uint32_t *tracks;
-  gchar **fields;
-  GSList *tmplist = NULL;
-
-  fields = g_strsplit (path, "/", -1);
-  gchar *playlist_name;
-  playlist_name = g_strndup (fields[2], strlen (fields[2]) - 4);
-  DBG ("Adding:%s", playlist_name);
-  g_strfreev (fields);
-
-  playlist = LIBMTP_new_playlist_t ();
-  playlist->name = g_strdup (playlist_name);
-
-  file = fdopen (fi->fh, "r");
-  while (fgets (item_path, sizeof (item_path) - 1, file) != NULL)
-    {
-      g_strchomp (item_path);
-      item_id = parse_path (item_path);
-      if (item_id != -1)
-	{
-	  tmplist = g_slist_append (tmplist, GUINT_TO_POINTER (item_id));
-	  DBG ("Adding to tmplist:%d", item_id);
-	}
-    }
-  playlist->no_tracks = g_slist_length (tmplist);
-  tracks = g_malloc (playlist->no_tracks * sizeof (uint32_t));
   int i;
-  for (i = 0; i < playlist->no_tracks; i++)
+  for (i = 0; i < 4; i++)
     {
-      tracks[i] = (uint32_t) GPOINTER_TO_UINT (g_slist_nth_data (tmplist, i));
-      DBG ("Adding:%d-%d", i, tracks[i]);
+      if (storageArea[i].storage != NULL
+	  && storageArea[i].storage->id == storage_id)
+	return i;
     }
-  playlist->tracks = tracks;
-  DBG ("Total:%d", playlist->no_tracks);
+  return -1;
+}
 
-  int playlist_id = 0;
-  LIBMTP_playlist_t *tmp_playlist;
-  check_playlists ();
-  tmp_playlist = playlists;
-  while (tmp_playlist != NULL)
-    {
-      if (g_ascii_strcasecmp (tmp_playlist->name, playlist_name) == 0)
-	{
-	  playlist_id = playlist->playlist_id;
-	}
-      tmp_playlist = tmp_playlist->next;
-    }
+static void
+free_object (MTPObject * object)
+{
+  if (object->children)
+    g_array_free (object->children, TRUE);
+  g_free (object->path);
+  g_free (object);
+}
+
+/* Returns the list of child ids for a folder id, or for the root of the
+ * storage area when parent_id is 0 */
+static GArray *
+find_children (uint32_t parent_id, int storageid)
+{
+  MTPObject *parent;
+  if (parent_id == 0)
+    return (storageid < 0) ? NULL : storageArea[storageid].children;
+  parent = g_hash_table_lookup (object_index, GUINT_TO_POINTER (parent_id));
+  if (parent == NULL)
+    return NULL;
+  return parent->children;
+}
+
+/* Returns the generation counter of a folder, or of the root of the storage
+ * area when parent_id is 0 */
+static guint *
+find_generation (uint32_t parent_id, int storageid)
+{
+  MTPObject *parent;
+  if (parent_id == 0)
+    return (storageid < 0) ? NULL : &storageArea[storageid].generation;
+  parent = g_hash_table_lookup (object_index, GUINT_TO_POINTER (parent_id));
+  if (parent == NULL || parent->folder == NULL)
+    return NULL;
+  return &parent->generation;
+}
+
+/* Note that the contents of a folder have changed, which invalidates the
+ * negative lookups made in it */
+static void
+touch_folder (uint32_t parent_id, int storageid)
+{
+  guint *generation = find_generation (parent_id, storageid);
+  if (generation != NULL)
+    (*generation)++;
+}
 
-  if (playlist_id > 0)
+/* Add an object to the id index and, when its parent path is known, to the
+ * case-folded path index and its parent's list of children.  The first
+ * object seen for a path wins, so folders (indexed before files) shadow
+ * files of the same name. */
+static MTPObject *
+index_object (uint32_t id, uint32_t parent_id, int storageid,
+	      const gchar * parent_path, const gchar * name,
+	      LIBMTP_file_t * file, LIBMTP_folder_t * folder)
+{
+  MTPObject *object;
+  if (g_hash_table_lookup (object_index, GUINT_TO_POINTER (id)) != NULL)
     {
-      DBG ("Update playlist %d", playlist_id);
-      playlist->playlist_id = playlist_id;
-      ret = LIBMTP_Update_Playlist (device, playlist);
+      DBG ("duplicate object id %d", id);
+      return NULL;
     }
-  else
+  object = g_new0 (MTPObject, 1);
+  object->id = id;
+  object->parent_id = parent_id;
+  object->storageid = storageid;
+  object->file = file;
+  object->folder = folder;
+  if (folder != NULL)
+    object->children = g_array_new (FALSE, FALSE, sizeof (uint32_t));
+  g_hash_table_insert (object_index, GUINT_TO_POINTER (id), object);
+  index_version++;
+  if (parent_path != NULL && name != NULL)
     {
-      DBG ("New playlist");
-      ret = LIBMTP_Create_New_Playlist (device, playlist);
+      gchar *key;
+      GArray *siblings;
+      siblings = find_children (parent_id, storageid);
+      if (siblings != NULL)
+	g_array_append_val (siblings, id);
+      touch_folder (parent_id, storageid);
+      object->path = g_strconcat (parent_path, "/", name, NULL);
+      key = g_ascii_strdown (object->path, -1);
+      if (g_hash_table_lookup (path_index, key) == NULL)
+	g_hash_table_insert (path_index, key, object);
+      else
+	g_free (key);
     }
-  playlists_changed = TRUE;
-  return ret;
+  return object;
 }
 
-/* Find the file type based on extension */
-static LIBMTP_filetype_t
-find_filetype (const gchar * filename)
+static void
+index_folders (LIBMTP_folder_t * folder, int storageid,
+	       const gchar * parent_path)
 {
-  DBG ("find_filetype");
-  gchar **fields;
-  fields = g_strsplit (filename, ".", -1);
-  gchar *ptype;
-  ptype = g_strdup (fields[g_strv_length (fields) - 1]);
-  g_strfreev (fields);
-  LIBMTP_filetype_t filetype;
-
-  // This need to be kept constantly updated as new file types arrive.
-  if (!g_ascii_strncasecmp (ptype, "wav", 3))
-    {
-      filetype = LIBMTP_FILETYPE_WAV;
-    }
-  else if (!g_ascii_strncasecmp (ptype, "mp3", 3))
+  for (; folder != NULL; folder = folder->sibling)
     {
-      filetype = LIBMTP_FILETYPE_MP3;
+      MTPObject *object;
+      object = index_object (folder->folder_id, folder->parent_id, storageid,
+			     parent_path, folder->name, NULL, folder);
+      if (object != NULL)
+	index_folders (folder->child, storageid, object->path);
     }
-  else if (!g_ascii_strncasecmp (ptype, "wma", 3))
+}
+
+/* Index an object below the given parent folder, or below the root of the
+ * storage area when parent_id is 0 */
+static MTPObject *
+index_child (uint32_t id, uint32_t parent_id, int storageid,
+	     const gchar * name, LIBMTP_file_t * file,
+	     LIBMTP_folder_t * folder)
+{
+  MTPObject *object;
+  gchar *root = NULL;
+  const gchar *parent_path = NULL;
+  if (storageid < 0)
     {
-      filetype = LIBMTP_FILETYPE_WMA;
+      // Unknown storage, index by id only
     }
-  else if (!g_ascii_strncasecmp (ptype, "ogg", 3))
+  else if (parent_id == 0)
     {
-      filetype = LIBMTP_FILETYPE_OGG;
+      root = g_strconcat ("/",
+			  storageArea[storageid].storage->StorageDescription,
+			  NULL);
+      parent_path = root;
     }
-  else if (!g_ascii_strncasecmp (ptype, "aa", 2))
+  else
     {
-      filetype = LIBMTP_FILETYPE_AUDIBLE;
+      MTPObject *parent;
+      parent = g_hash_table_lookup (object_index,
+				    GUINT_TO_POINTER (parent_id));
+      if (parent != NULL && parent->folder != NULL)
+	parent_path = parent->path;
     }
-  else if (!g_ascii_strncasecmp (ptype, "mp4", 3))
+  object = index_object (id, parent_id, storageid, parent_path, name,
+			 file, folder);
+  g_free (root);
+  return object;
+}
+
+static MTPObject *
+index_file (LIBMTP_file_t * file)
+{
+  return index_child (file->item_id, file->parent_id,
+		      find_storage_by_id (file->storage_id), file->filename,
+		      file, NULL);
+}
+
+/* Rebuild the path and object indexes after the file or folder lists have
+ * been refreshed from the device */
+static void
+check_index ()
+{
+  check_folders ();
+  check_files ();
+  if (!index_changed)
+    return;
+
+  DBG ("Rebuilding index");
+  if (path_index == NULL)
     {
-      filetype = LIBMTP_FILETYPE_MP4;
+      path_index = g_hash_table_new_full (g_str_hash, g_str_equal,
+					  g_free, NULL);
+      negative_paths = g_hash_table_new_full (g_str_hash, g_str_equal,
+					      g_free, g_free);
+      object_index = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+					    NULL,
+					    (GDestroyNotify) free_object);
     }
-  else if (!g_ascii_strncasecmp (ptype, "wmv", 3))
+  if (listed_folders == NULL)
+    listed_folders = g_hash_table_new (g_direct_hash, g_direct_equal);
+  g_hash_table_remove_all (path_index);
+  g_hash_table_remove_all (object_index);
+  index_version++;
+  // Generations start again from zero
+  g_hash_table_remove_all (negative_paths);
+
+  int i;
+  for (i = 0; i < 4; i++)
     {
-      filetype = LIBMTP_FILETYPE_WMV;
+      if (storageArea[i].storage != NULL)
+	{
+	  gchar *root;
+	  if (storageArea[i].children == NULL)
+	    storageArea[i].children =
+	      g_array_new (FALSE, FALSE, sizeof (uint32_t));
+	  g_array_set_size (storageArea[i].children, 0);
+	  root = g_strconcat ("/", storageArea[i].storage->StorageDescription,
+			      NULL);
+	  index_folders (storageArea[i].folders, i, root);
+	  g_free (root);
+	}
     }
-  else if (!g_ascii_strncasecmp (ptype, "avi", 3))
+
+  LIBMTP_file_t *file;
+  for (file = files; file != NULL; file = file->next)
+    index_file (file);
+  check_lost_files ();
+  index_changed = FALSE;
+  DBG ("Index holds %d objects", g_hash_table_size (object_index));
+}
+
+/* Drop an object from the indexes.  If it owned its path, hand the path
+ * over to any sibling of the same name that it was shadowing. */
+static void
+unindex_object (MTPObject * object)
+{
+  GArray *siblings;
+  siblings = find_children (object->parent_id, object->storageid);
+  if (object->path != NULL)
     {
-      filetype = LIBMTP_FILETYPE_AVI;
+      gchar *key;
+      key = g_ascii_strdown (object->path, -1);
+      if (g_hash_table_lookup (path_index, key) == object)
+	{
+	  g_hash_table_remove (path_index, key);
+	  int i;
+	  for (i = 0; siblings != NULL && i < siblings->len; i++)
+	    {
+	      MTPObject *sibling;
+	      sibling = g_hash_table_lookup (object_index,
+					     GUINT_TO_POINTER (g_array_index
+							       (siblings,
+								uint32_t,
+								i)));
+	      if (sibling != NULL && sibling != object
+		  && sibling->path != NULL
+		  && g_ascii_strcasecmp (sibling->path, object->path) == 0)
+		{
+		  g_hash_table_insert (path_index, g_strdup (key), sibling);
+		  break;
+		}
+	    }
+	}
+      g_free (key);
     }
-  else if (!g_ascii_strncasecmp (ptype, "mpeg", 4)
-	   || !g_ascii_strncasecmp (ptype, "mpg", 3))
+  if (siblings != NULL)
     {
-      filetype = LIBMTP_FILETYPE_MPEG;
+      int i;
+      for (i = 0; i < siblings->len; i++)
+	{
+	  if (g_array_index (siblings, uint32_t, i) == object->id)
+	    {
+	      g_array_remove_index (siblings, i);
+	      break;
+	    }
+	}
+      touch_folder (object->parent_id, object->storageid);
     }
-  else if (!g_ascii_strncasecmp (ptype, "asf", 3))
+  if (object->file != NULL)
+    drop_chunks (object->id);
+  if (track_paths != NULL)
+    g_hash_table_remove (track_paths, GUINT_TO_POINTER (object->id));
+  g_hash_table_remove (object_index, GUINT_TO_POINTER (object->id));
+  index_version++;
+}
+
+/* Add a file that has just been sent to the device to the file list and
+ * the index, so that no full refresh of the file list is needed */
+static void
+add_file (LIBMTP_file_t * file)
+{
+  if (files_changed)
     {
-      filetype = LIBMTP_FILETYPE_ASF;
+      // The whole list is about to be fetched again
+      LIBMTP_destroy_file_t (file);
+      return;
     }
-  else if (!g_ascii_strncasecmp (ptype, "qt", 2)
-	   || !g_ascii_strncasecmp (ptype, "mov", 3))
+  if (file_prev != NULL)
     {
-      filetype = LIBMTP_FILETYPE_QT;
+      if (files != NULL)
+	g_hash_table_insert (file_prev, GUINT_TO_POINTER (files->item_id),
+			     file);
+      g_hash_table_insert (file_prev, GUINT_TO_POINTER (file->item_id),
+			   NULL);
     }
-  else if (!g_ascii_strncasecmp (ptype, "wma", 3))
+  file->next = files;
+  files = file;
+  if (!index_changed)
     {
-      filetype = LIBMTP_FILETYPE_WMA;
+      index_file (file);
+      if (is_lost_file (file))
+	lostfiles = g_slist_prepend (lostfiles, file);
     }
-  else if (!g_ascii_strncasecmp (ptype, "jpg", 3)
-	   || !g_ascii_strncasecmp (ptype, "jpeg", 4))
+}
+
+/* The file list is singly linked, so to unlink a file without a walk
+ * the file before each one is kept by id.  Built on first use after the
+ * list has been fetched again. */
+static void
+link_files ()
+{
+  LIBMTP_file_t *file, *prev = NULL;
+  if (file_prev != NULL)
+    return;
+  file_prev = g_hash_table_new (g_direct_hash, g_direct_equal);
+  for (file = files; file != NULL; prev = file, file = file->next)
+    g_hash_table_insert (file_prev, GUINT_TO_POINTER (file->item_id), prev);
+}
+
+static void
+forget_file_links ()
+{
+  if (file_prev != NULL)
+    g_hash_table_destroy (file_prev);
+  file_prev = NULL;
+}
+
+/* Remove a file that has just been deleted from the device from the file
+ * list and the index */
+static void
+remove_file (uint32_t item_id)
+{
+  LIBMTP_file_t *file, *prev;
+  MTPObject *object;
+  gpointer value;
+  if (files_changed)
+    return;
+  if (!index_changed)
     {
-      filetype = LIBMTP_FILETYPE_JPEG;
+      object = g_hash_table_lookup (object_index, GUINT_TO_POINTER (item_id));
+      if (object != NULL)
+	unindex_object (object);
     }
-  else if (!g_ascii_strncasecmp (ptype, "jfif", 4))
+  link_files ();
+  if (!g_hash_table_lookup_extended (file_prev, GUINT_TO_POINTER (item_id),
+				     NULL, &value))
+    return;
+  prev = value;
+  file = (prev == NULL) ? files : prev->next;
+  if (prev == NULL)
+    files = file->next;
+  else
+    prev->next = file->next;
+  if (file->next != NULL)
+    g_hash_table_insert (file_prev, GUINT_TO_POINTER (file->next->item_id),
+			 prev);
+  g_hash_table_remove (file_prev, GUINT_TO_POINTER (item_id));
+  file->next = NULL;
+  lostfiles = g_slist_remove (lostfiles, file);
+  LIBMTP_destroy_file_t (file);
+}
+
+/* Find the folder tree node for a folder id, using the index if it is
+ * current */
+static LIBMTP_folder_t *
+find_folder (int storageid, uint32_t folder_id)
+{
+  if (!index_changed)
     {
-      filetype = LIBMTP_FILETYPE_JFIF;
+      MTPObject *object;
+      object = g_hash_table_lookup (object_index,
+				    GUINT_TO_POINTER (folder_id));
+      return (object != NULL) ? object->folder : NULL;
     }
-  else if (!g_ascii_strncasecmp (ptype, "tif", 3)
-	   || !g_ascii_strncasecmp (ptype, "tiff", 4))
+  return LIBMTP_Find_Folder (storageArea[storageid].folders, folder_id);
+}
+
+/* Link a folder that has just been created on the device into the folder
+ * tree and the index, so that the tree need not be fetched again */
+static void
+add_folder (int storageid, uint32_t folder_id, uint32_t parent_id,
+	    const gchar * name)
+{
+  LIBMTP_folder_t *folder, *parent = NULL;
+  if (storageArea[storageid].folders_changed)
+    return;
+  if (parent_id != 0)
     {
-      filetype = LIBMTP_FILETYPE_TIFF;
+      parent = find_folder (storageid, parent_id);
+      if (parent == NULL)
+	{
+	  DBG ("parent %d of new folder %d not known", parent_id, folder_id);
+	  storageArea[storageid].folders_changed = TRUE;
+	  return;
+	}
     }
-  else if (!g_ascii_strncasecmp (ptype, "bmp", 3))
+  folder = LIBMTP_new_folder_t ();
+  folder->folder_id = folder_id;
+  folder->parent_id = parent_id;
+  folder->storage_id = storageArea[storageid].storage->id;
+  folder->name = g_strdup (name);
+  if (parent == NULL)
     {
-      filetype = LIBMTP_FILETYPE_BMP;
+      folder->sibling = storageArea[storageid].folders;
+      storageArea[storageid].folders = folder;
     }
-  else if (!g_ascii_strncasecmp (ptype, "gif", 3))
+  else
     {
-      filetype = LIBMTP_FILETYPE_GIF;
+      folder->sibling = parent->child;
+      parent->child = folder;
     }
-  else if (!g_ascii_strncasecmp (ptype, "pic", 3)
-	   || !g_ascii_strncasecmp (ptype, "pict", 4))
+  if (!index_changed)
+    index_child (folder_id, parent_id, storageid, name, NULL, folder);
+}
+
+/* Unlink an empty folder that has just been deleted from the device from
+ * the folder tree and the index */
+static void
+remove_folder (int storageid, uint32_t folder_id)
+{
+  LIBMTP_folder_t *folder, **link;
+  if (storageArea[storageid].folders_changed)
+    return;
+  folder = find_folder (storageid, folder_id);
+  if (folder == NULL)
+    return;
+  if (folder->parent_id == 0)
     {
-      filetype = LIBMTP_FILETYPE_PICT;
+      link = &storageArea[storageid].folders;
     }
-  else if (!g_ascii_strncasecmp (ptype, "png", 3))
+  else
     {
-      filetype = LIBMTP_FILETYPE_PNG;
+      LIBMTP_folder_t *parent = find_folder (storageid, folder->parent_id);
+      if (parent == NULL)
+	{
+	  storageArea[storageid].folders_changed = TRUE;
+	  return;
+	}
+      link = &parent->child;
     }
-  else if (!g_ascii_strncasecmp (ptype, "wmf", 3))
+  while (*link != NULL && *link != folder)
+    link = &(*link)->sibling;
+  if (*link == NULL)
     {
-      filetype = LIBMTP_FILETYPE_WINDOWSIMAGEFORMAT;
+      storageArea[storageid].folders_changed = TRUE;
+      return;
     }
-  else if (!g_ascii_strncasecmp (ptype, "ics", 3))
+  if (!index_changed)
     {
-      filetype = LIBMTP_FILETYPE_VCALENDAR2;
+      MTPObject *object;
+      object = g_hash_table_lookup (object_index,
+				    GUINT_TO_POINTER (folder_id));
+      if (object != NULL)
+	unindex_object (object);
     }
-  else if (!g_ascii_strncasecmp (ptype, "exe", 3)
-	   || !g_ascii_strncasecmp (ptype, "com", 3)
-	   || !g_ascii_strncasecmp (ptype, "bat", 3)
-	   || !g_ascii_strncasecmp (ptype, "dll", 3)
-	   || !g_ascii_strncasecmp (ptype, "sys", 3))
+  *link = folder->sibling;
+  folder->sibling = NULL;
+  LIBMTP_destroy_folder_t (folder);
+  if (listed_folders != NULL)
+    g_hash_table_remove (listed_folders, GUINT_TO_POINTER (folder_id));
+}
+
+/* Remove an object, and everything below it if it is a folder, from the
+ * file list, folder tree and index after it has gone from the device */
+static void
+remove_object (MTPObject * object)
+{
+  if (object->folder != NULL)
     {
-      filetype = LIBMTP_FILETYPE_WINEXEC;
+      uint32_t folder_id = object->id;
+      int storageid = object->storageid;
+      GArray *ids;
+      int i;
+      ids = g_array_sized_new (FALSE, FALSE, sizeof (uint32_t),
+			       object->children->len);
+      g_array_append_vals (ids, object->children->data,
+			   object->children->len);
+      for (i = 0; i < ids->len; i++)
+	{
+	  MTPObject *child;
+	  child = g_hash_table_lookup (object_index,
+				       GUINT_TO_POINTER (g_array_index
+							 (ids, uint32_t, i)));
+	  if (child != NULL)
+	    remove_object (child);
+	}
+      g_array_free (ids, TRUE);
+      remove_folder (storageid, folder_id);
     }
-  else if (!g_ascii_strncasecmp (ptype, "txt", 3))
+  else
     {
-      filetype = LIBMTP_FILETYPE_TEXT;
+      remove_file (object->id);
     }
-  else if (!g_ascii_strncasecmp (ptype, "htm", 3)
-	   || !g_ascii_strncasecmp (ptype, "html", 4))
+}
+
+/* Fetch the contents of a single folder (folder_id 0 for the root of the
+ * storage area) and bring the file list, folder tree and index in line
+ * with them.  The index must be current. */
+static void
+sync_folder (int storageid, uint32_t folder_id)
+{
+  LIBMTP_file_t *list, *item, *next;
+  GArray *children;
+  GHashTable *seen;
+  int i;
+
+  DBG ("Listing folder %d on storage %d", folder_id, storageid);
+  list = LIBMTP_Get_Files_And_Folders (device,
+				       storageArea[storageid].storage->id,
+				       (folder_id ==
+					0 ? LIBMTP_FILES_AND_FOLDERS_ROOT :
+					folder_id));
+  seen = g_hash_table_new (g_direct_hash, g_direct_equal);
+  for (item = list; item != NULL; item = next)
     {
-      filetype = LIBMTP_FILETYPE_HTML;
+      MTPObject *object;
+      gboolean is_folder = (item->filetype == LIBMTP_FILETYPE_FOLDER);
+      next = item->next;
+      item->next = NULL;
+      item->parent_id = folder_id;
+      g_hash_table_add (seen, GUINT_TO_POINTER (item->item_id));
+      object = g_hash_table_lookup (object_index,
+				    GUINT_TO_POINTER (item->item_id));
+      if (object != NULL)
+	{
+	  const gchar *name;
+	  name = (object->folder != NULL) ? object->folder->name :
+	    object->file->filename;
+	  if (object->parent_id == folder_id
+	      && (object->folder != NULL) == is_folder
+	      && g_strcmp0 (name, item->filename) == 0)
+	    {
+	      // Already known, e.g. created through this mount
+	      if (object->file != NULL)
+		{
+		  if (object->file->filesize != item->filesize
+		      || object->file->modificationdate !=
+		      item->modificationdate)
+		    drop_chunks (object->id);
+		  object->file->filesize = item->filesize;
+		  object->file->modificationdate = item->modificationdate;
+		  object->file->filetype = item->filetype;
+		}
+	      LIBMTP_destroy_file_t (item);
+	      continue;
+	    }
+	  // Moved or renamed behind our back
+	  remove_object (object);
+	}
+      if (is_folder)
+	{
+	  add_folder (storageid, item->item_id, folder_id, item->filename);
+	  LIBMTP_destroy_file_t (item);
+	}
+      else
+	{
+	  add_file (item);
+	}
     }
-  else if (!g_ascii_strncasecmp (ptype, "bin", 3))
+
+  // Drop whatever has disappeared from the folder
+  GArray *gone;
+  gone = g_array_new (FALSE, FALSE, sizeof (uint32_t));
+  children = find_children (folder_id, storageid);
+  for (i = 0; children != NULL && i < children->len; i++)
     {
-      filetype = LIBMTP_FILETYPE_FIRMWARE;
+      uint32_t id = g_array_index (children, uint32_t, i);
+      if (!g_hash_table_contains (seen, GUINT_TO_POINTER (id)))
+	g_array_append_val (gone, id);
     }
-  else if (!g_ascii_strncasecmp (ptype, "aac", 3))
+  for (i = 0; i < gone->len; i++)
     {
-      filetype = LIBMTP_FILETYPE_AAC;
+      MTPObject *object;
+      object = g_hash_table_lookup (object_index,
+				    GUINT_TO_POINTER (g_array_index
+						      (gone, uint32_t, i)));
+      if (object != NULL)
+	remove_object (object);
     }
-  else if (!g_ascii_strncasecmp (ptype, "flac", 4)
-	   || !g_ascii_strncasecmp (ptype, "fla", 3))
-    {
-      filetype = LIBMTP_FILETYPE_FLAC;
-    }
-  else if (!g_ascii_strncasecmp (ptype, "mp2", 3))
+  g_array_free (gone, TRUE);
+  g_hash_table_destroy (seen);
+
+  if (folder_id == 0)
+    storageArea[storageid].listed = TRUE;
+  else
+    g_hash_table_add (listed_folders, GUINT_TO_POINTER (folder_id));
+  index_version++;
+}
+
+/* Whether the contents of a folder have been fetched in lazy mode */
+static gboolean
+folder_listed (int storageid, uint32_t folder_id)
+{
+  if (folder_id == 0)
+    return storageArea[storageid].listed;
+  return g_hash_table_contains (listed_folders, GUINT_TO_POINTER (folder_id));
+}
+
+/* Whether folders are fetched as they are visited: always in lazy mode,
+ * and otherwise until the warm-up walk has covered the device */
+static gboolean
+listing_on_demand ()
+{
+  return lazy_listing || warming_up;
+}
+
+/* Fetch the contents of a single folder (folder_id 0 for the root of the
+ * storage area) the first time it is visited, when listing on demand.  The
+ * index must be current. */
+static void
+list_folder (int storageid, uint32_t folder_id)
+{
+  if (listing_on_demand () && !folder_listed (storageid, folder_id))
+    sync_folder (storageid, folder_id);
+}
+
+/* Make sure the children of a folder are known */
+static void
+list_object (MTPObject * object)
+{
+  if (object != NULL && object->folder != NULL)
+    list_folder (object->storageid, object->id);
+}
+
+/* Whether key is a path recently found not to exist, in a folder that has
+ * not changed since */
+static gboolean
+negative_lookup (const gchar * key)
+{
+  NegativeEntry *entry;
+  guint *generation;
+  entry = g_hash_table_lookup (negative_paths, key);
+  if (entry == NULL)
+    return FALSE;
+  generation = find_generation (entry->parent_id, entry->storageid);
+  if (generation != NULL && *generation == entry->generation
+      && !(listing_on_demand ()
+	   && !folder_listed (entry->storageid, entry->parent_id)))
+    return TRUE;
+  g_hash_table_remove (negative_paths, key);
+  return FALSE;
+}
+
+/* Remember that the path in key does not exist, if its parent folder,
+ * key[0, parent_length), does */
+static void
+remember_negative (gchar * key, gsize parent_length, int storageid,
+		   MTPObject * parent)
+{
+  NegativeEntry *entry;
+  uint32_t parent_id = 0;
+  guint *generation;
+  if (parent != NULL)
     {
-      filetype = LIBMTP_FILETYPE_MP2;
+      if (parent->folder == NULL)
+	return;
+      parent_id = parent->id;
     }
-  else if (!g_ascii_strncasecmp (ptype, "m4a", 3))
+  else if (memchr (key + 1, '/', parent_length - 1) != NULL)
     {
-      filetype = LIBMTP_FILETYPE_M4A;
+      return;
     }
-  else if (!g_ascii_strncasecmp (ptype, "doc", 3))
+  generation = find_generation (parent_id, storageid);
+  if (generation == NULL)
+    return;
+  if (g_hash_table_size (negative_paths) >= NEGATIVE_CACHE_SIZE)
+    g_hash_table_remove_all (negative_paths);
+  entry = g_new (NegativeEntry, 1);
+  entry->storageid = storageid;
+  entry->parent_id = parent_id;
+  entry->generation = *generation;
+  g_hash_table_replace (negative_paths, g_strdup (key), entry);
+}
+
+/* Resolve the first length bytes of the folded path in key.  The buffer is
+ * NUL terminated at length while the lookup runs and restored afterwards;
+ * parent folders are resolved the same way, one level shorter each time. */
+static MTPObject *
+resolve_key (gchar * key, gsize length, int storageid)
+{
+  MTPObject *object, *parent = NULL;
+  gchar saved = key[length];
+  gsize parent_length;
+
+  key[length] = '\0';
+  object = g_hash_table_lookup (path_index, key);
+  parent_length = strrchr (key, '/') - key;
+  if (object == NULL && parent_length > 0 && !negative_lookup (key))
     {
-      filetype = LIBMTP_FILETYPE_DOC;
+      gboolean in_root = memchr (key + 1, '/', parent_length - 1) == NULL;
+      if (!in_root)
+	parent = resolve_key (key, parent_length, storageid);
+      if (listing_on_demand ())
+	{
+	  // List the parent folder, if it exists, and try again
+	  if (in_root)
+	    list_folder (storageid, 0);
+	  else
+	    list_object (parent);
+	  object = g_hash_table_lookup (path_index, key);
+	}
+      if (object == NULL)
+	remember_negative (key, parent_length, storageid, parent);
     }
-  else if (!g_ascii_strncasecmp (ptype, "xml", 3))
+  key[length] = saved;
+  return object;
+}
+
+/* Fold a request path into mp and find where its last component starts.
+ * Returns FALSE if the path is too long or is not below a storage area. */
+static gboolean
+split_path (MTPPath * mp, const gchar * path)
+{
+  gsize i;
+  const gchar *slash = NULL;
+  for (i = 0; path[i] != '\0'; i++)
     {
-      filetype = LIBMTP_FILETYPE_XML;
+      if (i + 1 >= sizeof (mp->key))
+	return FALSE;
+      mp->key[i] = g_ascii_tolower (path[i]);
+      if (path[i] == '/')
+	slash = path + i;
     }
-  else if (!g_ascii_strncasecmp (ptype, "xls", 3))
+  mp->key[i] = '\0';
+  mp->length = i;
+  if (slash == NULL)
+    return FALSE;
+  mp->parent_length = slash - path;
+  mp->name = slash + 1;
+  mp->storageid = find_storage (path);
+  return mp->storageid >= 0;
+}
+
+/* Resolve a split path to an object, NULL if it does not exist or names
+ * the root of a storage area */
+static MTPObject *
+resolve_path (MTPPath * mp)
+{
+  if (mp->parent_length == 0)
+    return NULL;
+  check_index ();
+  return resolve_key (mp->key, mp->length, mp->storageid);
+}
+
+/* Returns the folder id of the parent of a split path, 0 if it is the root
+ * of a storage area or -1 if it is not a folder */
+static int
+resolve_parent (MTPPath * mp)
+{
+  MTPObject *parent;
+  if (mp->parent_length == 0
+      || memchr (mp->key + 1, '/', mp->parent_length - 1) == NULL)
+    return 0;
+  check_index ();
+  parent = resolve_key (mp->key, mp->parent_length, mp->storageid);
+  if (parent == NULL || parent->folder == NULL)
+    return -1;
+  return parent->id;
+}
+
+/* Find a file or folder on the device by its full path */
+static MTPObject *
+lookup_path (const gchar * path)
+{
+  MTPPath mp;
+  if (!split_path (&mp, path))
+    return NULL;
+  return resolve_path (&mp);
+}
+
+static void
+free_snapshot_entry (SnapshotEntry * entry)
+{
+  g_free (entry->name);
+  if (entry->children != NULL)
+    g_ptr_array_free (entry->children, TRUE);
+  g_free (entry);
+}
+
+static void
+unref_snapshot (Snapshot * snapshot)
+{
+  if (!g_atomic_int_dec_and_test (&snapshot->refs))
+    return;
+  g_hash_table_destroy (snapshot->paths);
+  g_ptr_array_free (snapshot->entries, TRUE);
+  g_free (snapshot);
+}
+
+static Snapshot *
+ref_snapshot (Snapshot ** slot)
+{
+  Snapshot *snapshot;
+  g_mutex_lock (&snapshot_lock);
+  snapshot = *slot;
+  if (snapshot != NULL)
+    g_atomic_int_inc (&snapshot->refs);
+  g_mutex_unlock (&snapshot_lock);
+  return snapshot;
+}
+
+static void
+swap_snapshot (Snapshot ** slot, Snapshot * snapshot)
+{
+  Snapshot *old;
+  g_mutex_lock (&snapshot_lock);
+  old = *slot;
+  *slot = snapshot;
+  g_mutex_unlock (&snapshot_lock);
+  if (old != NULL)
+    unref_snapshot (old);
+}
+
+static void
+add_snapshot_children (SnapshotEntry * entry, GArray * children,
+		       GHashTable * entries)
+{
+  int i;
+  entry->children = g_ptr_array_sized_new (children->len);
+  for (i = 0; i < children->len; i++)
     {
-      filetype = LIBMTP_FILETYPE_XLS;
+      MTPObject *child;
+      SnapshotEntry *child_entry;
+      child = g_hash_table_lookup (object_index,
+				   GUINT_TO_POINTER (g_array_index
+						     (children, uint32_t,
+						      i)));
+      child_entry = g_hash_table_lookup (entries, child);
+      if (child_entry != NULL)
+	g_ptr_array_add (entry->children, child_entry);
     }
-  else if (!g_ascii_strncasecmp (ptype, "ppt", 3))
+}
+
+static Snapshot *
+new_snapshot ()
+{
+  Snapshot *snapshot = g_new0 (Snapshot, 1);
+  snapshot->refs = 1;
+  snapshot->paths = g_hash_table_new_full (g_str_hash, g_str_equal,
+					   g_free, NULL);
+  snapshot->entries =
+    g_ptr_array_new_with_free_func ((GDestroyNotify) free_snapshot_entry);
+  return snapshot;
+}
+
+/* Size of an open replacement as it stands.  Its lock is not taken, as
+ * the device lock may be held; complete only ever becomes TRUE. */
+static uint64_t
+replacement_size (MTPHandle * handle)
+{
+  struct stat st;
+  uint64_t size = 0;
+  if (handle->fd != -1 && fstat (handle->fd, &st) == 0)
+    size = st.st_size;
+  if (!handle->complete)
+    size = MAX (size, handle->old_size);
+  return size;
+}
+
+/* Size a file will have once its replacement, open or queued, is sent.
+ * Called with the device lock held. */
+static gboolean
+pending_replacement (const gchar * path, uint64_t * size)
+{
+  MTPHandle *handle = NULL;
+  QueuedUpload *job = NULL;
+  gboolean found = FALSE;
+  if (replacing != NULL)
+    handle = g_hash_table_lookup (replacing, path);
+  if (handle != NULL)
     {
-      filetype = LIBMTP_FILETYPE_PPT;
+      *size = replacement_size (handle);
+      return TRUE;
     }
-  else if (!g_ascii_strncasecmp (ptype, "mht", 3))
+  g_mutex_lock (&upload_queue_lock);
+  if (queued_uploads != NULL)
+    job = g_hash_table_lookup (queued_uploads, path);
+  if (job != NULL && job->replace_id != 0)
     {
-      filetype = LIBMTP_FILETYPE_MHT;
+      *size = job->filesize;
+      found = TRUE;
     }
-  else if (!g_ascii_strncasecmp (ptype, "jp2", 3))
+  g_mutex_unlock (&upload_queue_lock);
+  return found;
+}
+
+static SnapshotEntry *
+add_pending_entry (Snapshot * pending, const gchar * path)
+{
+  SnapshotEntry *entry = g_new0 (SnapshotEntry, 1);
+  entry->pending = TRUE;
+  entry->name = g_strdup (strrchr (path, '/') + 1);
+  g_ptr_array_add (pending->entries, entry);
+  g_hash_table_replace (pending->paths, g_ascii_strdown (path, -1), entry);
+  return entry;
+}
+
+/* Files not sent yet are kept apart from the index snapshot, as they
+ * come and go with every file copied in and are cheap to list.  Files
+ * being replaced are there too, for their new size: those still open
+ * change size as they are written, so they are stale. */
+static void
+publish_pending ()
+{
+  Snapshot *pending = new_snapshot ();
+  SnapshotEntry *entry;
+  GHashTableIter iter;
+  gpointer key, value;
+  GSList *item;
+  for (item = myfiles; item != NULL; item = item->next)
     {
-      filetype = LIBMTP_FILETYPE_JP2;
+      entry = add_pending_entry (pending, item->data);
+      entry->size = queued_size (item->data);
     }
-  else if (!g_ascii_strncasecmp (ptype, "jpx", 3))
+  g_mutex_lock (&upload_queue_lock);
+  if (queued_uploads != NULL)
     {
-      filetype = LIBMTP_FILETYPE_JPX;
+      g_hash_table_iter_init (&iter, queued_uploads);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+	{
+	  QueuedUpload *job = value;
+	  if (job->replace_id == 0)
+	    continue;
+	  entry = add_pending_entry (pending, key);
+	  entry->id = job->replace_id;
+	  entry->size = job->filesize;
+	}
     }
-  else
+  g_mutex_unlock (&upload_queue_lock);
+  if (replacing != NULL)
     {
-      DBG ("Sorry, file type \"%s\" is not yet supported", ptype);
-      DBG ("Tagging as unknown file type.");
-      filetype = LIBMTP_FILETYPE_UNKNOWN;
+      g_hash_table_iter_init (&iter, replacing);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+	{
+	  MTPHandle *handle = value;
+	  entry = add_pending_entry (pending, key);
+	  entry->id = handle->replace_id;
+	  entry->stale = TRUE;
+	}
     }
-  g_free (ptype);
-  return filetype;
+  swap_snapshot (&current_pending, pending);
 }
 
-static int
-find_storage (const gchar * path)
+static SnapshotEntry *
+add_special_entry (Snapshot * snapshot, SnapshotEntry * parent,
+		   const gchar * path, const gchar * name)
+{
+  SnapshotEntry *entry = g_new0 (SnapshotEntry, 1);
+  entry->name = g_strdup (name);
+  g_ptr_array_add (snapshot->entries, entry);
+  g_ptr_array_add (parent->children, entry);
+  g_hash_table_replace (snapshot->paths, g_ascii_strdown (path, -1), entry);
+  return entry;
+}
+
+/* The mount root, Playlists and lost+found */
+static void
+add_special_entries (Snapshot * snapshot, GPtrArray * storages)
 {
+  SnapshotEntry *root, *folder, *entry;
+  LIBMTP_playlist_t *playlist;
+  GSList *item;
+  gchar *path;
   int i;
-  DBG ("find_storage:%s", path);
-  for (i = 0; i < 4; i++)
+
+  root = g_new0 (SnapshotEntry, 1);
+  root->folder = TRUE;
+  root->listed = TRUE;
+  root->children = g_ptr_array_new ();
+  g_ptr_array_add (snapshot->entries, root);
+  // Top level names are looked up with an empty parent
+  g_hash_table_replace (snapshot->paths, g_strdup ("/"), root);
+  g_hash_table_replace (snapshot->paths, g_strdup (""), root);
+
+  // Playlists are only known once loaded; until then the folder is
+  // there but stale, so lookups in it take the locked path
+  folder = add_special_entry (snapshot, root, "/Playlists", "Playlists");
+  folder->folder = TRUE;
+  folder->children = g_ptr_array_new ();
+  if (playlists_changed)
     {
-      if (storageArea[i].storage != NULL)
+      folder->stale = TRUE;
+    }
+  else
+    {
+      folder->listed = TRUE;
+      for (playlist = playlists; playlist != NULL; playlist = playlist->next)
 	{
-	  int maxlen = strlen (storageArea[i].storage->StorageDescription);
-	  if (strlen (path + 1) < maxlen)
-	    maxlen = strlen (path + 1);
-	  if (strncmp
-	      (storageArea[i].storage->StorageDescription,
-	       path + 1, maxlen) == 0)
+	  PlaylistRender *render = NULL;
+	  gchar *name = g_strdup_printf ("%s.m3u", playlist->name);
+	  path = g_strconcat ("/Playlists/", name, NULL);
+	  entry = add_special_entry (snapshot, folder, path, name);
+	  entry->id = playlist->playlist_id;
+	  // The size is that of the text, which may need rendering
+	  if (playlist_renders != NULL)
+	    render = g_hash_table_lookup (playlist_renders,
+					  GUINT_TO_POINTER
+					  (playlist->playlist_id));
+	  if (render != NULL && render->playlists_version == playlists_version
+	      && render->index_version == index_version)
 	    {
-	      DBG ("%s found as %d",
-		   storageArea[i].storage->StorageDescription, i);
-	      return i;
+	      entry->size = render->length;
+	      entry->modified = time (NULL);
+	    }
+	  else
+	    {
+	      entry->stale = TRUE;
 	    }
+	  g_free (path);
+	  g_free (name);
 	}
     }
-  DBG ("could not find storage for %s", path);
-  return -1;
+
+  if (lostfiles != NULL)
+    {
+      folder = add_special_entry (snapshot, root, "/lost+found",
+				  "lost+found");
+      folder->folder = TRUE;
+      folder->listed = TRUE;
+      folder->children = g_ptr_array_new ();
+      for (item = lostfiles; item != NULL; item = item->next)
+	{
+	  LIBMTP_file_t *file = item->data;
+	  if (file->filename == NULL)
+	    continue;
+	  path = g_strconcat ("/lost+found/", file->filename, NULL);
+	  entry = add_special_entry (snapshot, folder, path, file->filename);
+	  entry->id = file->item_id;
+	  entry->size = file->filesize;
+	  entry->modified = file->modificationdate;
+	  g_free (path);
+	}
+    }
+
+  for (i = 0; i < storages->len; i++)
+    g_ptr_array_add (root->children, g_ptr_array_index (storages, i));
 }
 
-static int
-lookup_folder_id (LIBMTP_folder_t * folderlist, gchar * path, gchar * parent)
+/* Publish a snapshot of the index if it has changed since the last one.
+ * Called with the device lock held, as it is let go.  While the index is
+ * waiting to be rebuilt nothing is published, and lookups take the
+ * locked path.  A rebuild copies the whole index, so it is done at most
+ * once a second; a change that comes sooner withdraws the snapshot until
+ * then. */
+static void
+publish_snapshot ()
 {
-  DBG ("lookup_folder_id %s,%s", path, parent);
-  int ret = -1;
-  if (folderlist == NULL)
+  Snapshot *snapshot;
+  GHashTable *entries;
+  GHashTableIter iter;
+  GPtrArray *storages;
+  gpointer value;
+  guint playlists_state;
+  gint64 now;
+  int i;
+
+  if (published_myfiles_version != myfiles_version)
     {
-      return -1;
+      published_myfiles_version = myfiles_version;
+      publish_pending ();
     }
-  gchar *mypath;
-  mypath = path;
-  check_folders ();
-  if (parent == NULL)
+  playlists_state = playlists_changed ? 0 : playlists_version + 1;
+  if (current_snapshot != NULL && published_index_version == index_version
+      && published_playlists == playlists_state)
+    return;
+  now = g_get_monotonic_time ();
+  if (now - published_at < G_USEC_PER_SEC)
+    {
+      if (current_snapshot != NULL)
+	swap_snapshot (&current_snapshot, NULL);
+      return;
+    }
+  published_index_version = index_version;
+  published_playlists = playlists_state;
+  published_at = now;
+  gboolean ready = (path_index != NULL && !index_changed && !files_changed);
+  for (i = 0; i < 4; i++)
+    {
+      if (storageArea[i].storage != NULL && storageArea[i].folders_changed)
+	ready = FALSE;
+    }
+  if (!ready)
+    {
+      swap_snapshot (&current_snapshot, NULL);
+      return;
+    }
+
+  snapshot = new_snapshot ();
+  entries = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  // Objects whose path is in use come first, so they win their path
+  g_hash_table_iter_init (&iter, object_index);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
     {
-      if (g_strrstr (path + 1, "/") == NULL)
+      MTPObject *object = value;
+      SnapshotEntry *entry;
+      gchar *key;
+      if (object->path == NULL)
+	continue;
+      key = g_ascii_strdown (object->path, -1);
+      if (g_hash_table_lookup (path_index, key) == object)
 	{
-	  DBG ("Storage dir");
-	  return -2;
+	  entry = g_new0 (SnapshotEntry, 1);
+	  g_hash_table_insert (entries, object, entry);
+	  g_ptr_array_add (snapshot->entries, entry);
+	  g_hash_table_insert (snapshot->paths, key, entry);
 	}
       else
 	{
-	  DBG ("Strip storage area name");
-	  mypath = strstr (path + 1, "/");
-	  parent = "";
+	  g_free (key);
 	}
     }
-
-  gchar *current;
-  current = g_strconcat (parent, "/", folderlist->name, NULL);
-  LIBMTP_devicestorage_t *storage;
-
-  DBG ("compare %s,%s", mypath, current);
-  if (g_ascii_strcasecmp (mypath, current) == 0)
+  g_hash_table_iter_init (&iter, object_index);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
     {
-      ret = folderlist->folder_id;
+      MTPObject *object = value;
+      SnapshotEntry *entry;
+      if (object->path == NULL)
+	continue;
+      entry = g_hash_table_lookup (entries, object);
+      if (entry == NULL)
+	{
+	  // Shadowed by a sibling of the same name, but still listed
+	  entry = g_new0 (SnapshotEntry, 1);
+	  g_hash_table_insert (entries, object, entry);
+	  g_ptr_array_add (snapshot->entries, entry);
+	}
+      entry->id = object->id;
+      if (object->folder != NULL)
+	{
+	  entry->name = g_strdup (object->folder->name);
+	  entry->folder = TRUE;
+	  entry->listed = !listing_on_demand ()
+	    || folder_listed (object->storageid, object->id);
+	}
+      else
+	{
+	  entry->name = g_strdup (object->file->filename);
+	  entry->size = object->file->filesize;
+	  entry->modified = object->file->modificationdate;
+	}
     }
-  else if (g_ascii_strncasecmp (mypath, current, strlen (current)) == 0)
+  g_hash_table_iter_init (&iter, entries);
+  while (g_hash_table_iter_next (&iter, &value, NULL))
     {
-      ret = lookup_folder_id (folderlist->child, mypath, current);
+      MTPObject *object = value;
+      if (object->folder != NULL)
+	add_snapshot_children (g_hash_table_lookup (entries, object),
+			       object->children, entries);
     }
 
-  if (ret == -1)
+  storages = g_ptr_array_new ();
+  for (i = 0; i < 4; i++)
     {
-      ret = lookup_folder_id (folderlist->sibling, mypath, parent);
+      SnapshotEntry *entry;
+      gchar *root;
+      if (storageArea[i].storage == NULL)
+	continue;
+      entry = g_new0 (SnapshotEntry, 1);
+      entry->id = storageArea[i].storage->id;
+      entry->name = g_strdup (storageArea[i].storage->StorageDescription);
+      entry->folder = TRUE;
+      entry->listed = !listing_on_demand () || folder_listed (i, 0);
+      add_snapshot_children (entry, storageArea[i].children, entries);
+      root = g_strconcat ("/", entry->name, NULL);
+      g_hash_table_replace (snapshot->paths, g_ascii_strdown (root, -1),
+			    entry);
+      g_ptr_array_add (snapshot->entries, entry);
+      g_ptr_array_add (storages, entry);
+      g_free (root);
     }
-  g_free (current);
-  return ret;
+
+  add_special_entries (snapshot, storages);
+  g_ptr_array_free (storages, TRUE);
+  g_hash_table_destroy (entries);
+  DBG ("Published snapshot of %d paths", g_hash_table_size (snapshot->paths));
+  swap_snapshot (&current_snapshot, snapshot);
 }
 
-static int
-parse_path (const gchar * path)
+/* Split a path for a snapshot lookup.  Paths outside the storage areas,
+ * such as the root and Playlists, are in the snapshot too. */
+static gboolean
+split_snapshot_path (MTPPath * mp, const gchar * path)
 {
-  DBG ("parse_path:%s", path);
-  int res;
-  int item_id = -1;
-  int i;
-  // Check cached files first
-  GSList *item;
-  item = g_slist_find_custom (myfiles, path, (GCompareFunc) strcmp);
-  if (item != NULL)
-    return 0;
+  if (strlen (path) >= sizeof (mp->key))
+    return FALSE;
+  split_path (mp, path);
+  return TRUE;
+}
 
-  // Check Playlists
-  if (strncmp ("/Playlists", path, 10) == 0)
-    {
-      LIBMTP_playlist_t *playlist;
+static void
+pending_stat (SnapshotEntry * entry, struct stat *stbuf)
+{
+  struct fuse_context *fc = fuse_get_context ();
+  memset (stbuf, 0, sizeof (struct stat));
+  stbuf->st_uid = fc->uid;
+  stbuf->st_gid = fc->gid;
+  stbuf->st_mode = S_IFREG | 0777;
+  stbuf->st_size = entry->size;
+  stbuf->st_blocks = 2;
+  stbuf->st_mtime = time (NULL);
+}
 
-      res = -ENOENT;
-      check_playlists ();
-      playlist = playlists;
-      while (playlist != NULL)
+/* getattr from the snapshot, without the device lock.  Returns 1 if the
+ * snapshot cannot tell. */
+static int
+snapshot_getattr (const gchar * path, struct stat *stbuf)
+{
+  Snapshot *snapshot;
+  SnapshotEntry *entry, *parent;
+  MTPPath mp;
+  int ret = 1;
+
+  if (!split_snapshot_path (&mp, path))
+    return 1;
+  // Files not sent yet hide whatever the device has at their path
+  snapshot = ref_snapshot (&current_pending);
+  if (snapshot != NULL)
+    {
+      entry = g_hash_table_lookup (snapshot->paths, mp.key);
+      if (entry != NULL && !entry->stale)
+	pending_stat (entry, stbuf);
+      unref_snapshot (snapshot);
+      if (entry != NULL)
+	return entry->stale ? 1 : 0;
+    }
+  snapshot = ref_snapshot (&current_snapshot);
+  if (snapshot == NULL)
+    return 1;
+  entry = g_hash_table_lookup (snapshot->paths, mp.key);
+  if (entry != NULL && entry->stale)
+    {
+      ret = 1;
+    }
+  else if (entry != NULL)
+    {
+      struct fuse_context *fc = fuse_get_context ();
+      memset (stbuf, 0, sizeof (struct stat));
+      stbuf->st_uid = fc->uid;
+      stbuf->st_gid = fc->gid;
+      if (entry->folder)
 	{
-	  gchar *tmppath;
-	  tmppath = g_strconcat ("/Playlists/", playlist->name, ".m3u", NULL);
-	  if (g_ascii_strcasecmp (path, tmppath) == 0)
-	    {
-	      res = playlist->playlist_id;
-	      g_free (tmppath);
-	      break;
-	    }
-	  g_free (tmppath);
-	  playlist = playlist->next;
+	  stbuf->st_ino = entry->id;
+	  stbuf->st_mode = S_IFDIR | 0777;
+	  stbuf->st_nlink = 2;
 	}
-      return res;
+      else
+	{
+	  stbuf->st_ino = entry->id;
+	  stbuf->st_size = entry->size;
+	  stbuf->st_blocks = (entry->size / 512) +
+	    (entry->size % 512 > 0 ? 1 : 0);
+	  stbuf->st_nlink = 1;
+	  stbuf->st_mode = S_IFREG | 0777;
+	  stbuf->st_mtime = entry->modified;
+	  stbuf->st_ctime = entry->modified;
+	  stbuf->st_atime = entry->modified;
+	}
+      ret = 0;
     }
-  // Check lost+found
-  if (strncmp ("/lost+found", path, 11) == 0)
+  else
     {
-      GSList *item;
-      gchar *filename = g_path_get_basename (path);
+      mp.key[mp.parent_length] = '\0';
+      parent = g_hash_table_lookup (snapshot->paths, mp.key);
+      if (parent != NULL && parent->folder && parent->listed)
+	ret = -ENOENT;
+    }
+  unref_snapshot (snapshot);
+  return ret;
+}
 
-      res = -ENOENT;
-      for (item = lostfiles; item != NULL; item = g_slist_next (item))
-	{
-	  LIBMTP_file_t *file = (LIBMTP_file_t *) item->data;
+/* readdir from the snapshot, without the device lock.  Returns 1 if the
+ * snapshot cannot tell. */
+static int
+snapshot_readdir (const gchar * path, void *buf, fuse_fill_dir_t filler)
+{
+  Snapshot *snapshot;
+  Snapshot *pending;
+  SnapshotEntry *entry;
+  GHashTableIter iter;
+  gpointer key, value;
+  MTPPath mp;
+  int i;
 
-	  if (strcmp (file->filename, filename) == 0)
-	    {
-	      res = file->item_id;
-	      break;
-	    }
-	}
-      g_free (filename);
-      return res;
-    }
-  // Check device
-  LIBMTP_folder_t *folder;
-  gchar **fields;
-  gchar *directory;
-  directory = (gchar *) g_malloc (strlen (path) + 1);
-  directory = strcpy (directory, "");
-  fields = g_strsplit (path, "/", -1);
-  res = -ENOENT;
-  int storageid;
-  storageid = find_storage (path);
-  if (storageid < 0)
+  if (!split_snapshot_path (&mp, path))
+    return 1;
+  snapshot = ref_snapshot (&current_snapshot);
+  if (snapshot == NULL)
+    return 1;
+  entry = g_hash_table_lookup (snapshot->paths, mp.key);
+  if (entry == NULL || !entry->folder || !entry->listed)
     {
-      return res;
+      unref_snapshot (snapshot);
+      return 1;
     }
-  for (i = 0; fields[i] != NULL; i++)
+  filler (buf, ".", NULL, 0);
+  filler (buf, "..", NULL, 0);
+  for (i = 0; i < entry->children->len; i++)
     {
-      if (strlen (fields[i]) > 0)
-	{
-	  if (fields[i + 1] != NULL)
-	    {
-	      directory = strcat (directory, "/");
-	      directory = strcat (directory, fields[i]);
-	    }
-	  else
-	    {
-	      check_folders ();
-	      folder = storageArea[storageid].folders;
-	      int folder_id = 0;
-	      if (strcmp (directory, "") != 0)
-		{
-		  folder_id = lookup_folder_id (folder, directory, NULL);
-		}
-	      DBG ("parent id:%d:%s", folder_id, directory);
-	      LIBMTP_file_t *file;
-	      check_files ();
-	      file = files;
-	      while (file != NULL)
-		{
-		  if ((file->parent_id == folder_id) ||
-		      (folder_id == -2
-		       && (file->parent_id == 0)
-		       && (file->storage_id ==
-			   storageArea[storageid].storage->id)))
-		    {
-		      if (file->filename == NULL)
-			DBG ("MTPFS filename NULL");
-		      if (file->filename != NULL
-			  &&
-			  g_ascii_strcasecmp (file->filename, fields[i]) == 0)
-			{
-			  DBG ("found:%d:%s", file->item_id, file->filename);
-
-			  item_id = file->item_id;
-			  break;	// found!
-			}
-		    }
-		  file = file->next;
-		}
-	      if (item_id < 0)
-		{
-		  directory = strcat (directory, "/");
-		  directory = strcat (directory, fields[i]);
-		  item_id = lookup_folder_id (folder, directory, NULL);
-		  res = item_id;
-		  break;
-		}
-	      else
-		{
-		  res = item_id;
-		  break;
-		}
-	    }
-	}
+      SnapshotEntry *child = g_ptr_array_index (entry->children, i);
+      struct stat st;
+      memset (&st, 0, sizeof (st));
+      st.st_ino = child->id;
+      st.st_mode = child->folder ? (S_IFDIR | 0777) : (S_IFREG | 0444);
+      if (filler (buf, (child->name == NULL ? "<mtpfs null>" : child->name),
+		  &st, 0))
+	break;
     }
-  g_free (directory);
-  g_strfreev (fields);
-  DBG ("parse_path exiting:%s - %d", path, res);
-  return res;
+  unref_snapshot (snapshot);
+
+  // Files not sent yet, in this folder
+  pending = ref_snapshot (&current_pending);
+  if (pending == NULL)
+    return 0;
+  g_hash_table_iter_init (&iter, pending->paths);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      SnapshotEntry *child = value;
+      const gchar *slash = strrchr (key, '/');
+      struct stat st;
+      // Replacements are listed already, under the object they replace
+      if (child->id != 0 || slash - (gchar *) key != mp.length
+	  || strncmp (key, mp.key, mp.length) != 0)
+	continue;
+      memset (&st, 0, sizeof (st));
+      st.st_mode = S_IFREG | 0444;
+      if (filler (buf, child->name, &st, 0))
+	break;
+    }
+  unref_snapshot (pending);
+  return 0;
 }
 
-static int
-mtpfs_release (const char *path, struct fuse_file_info *fi)
+static void
+append_index_record (GByteArray * records, GString * names, uint32_t id,
+		     uint32_t parent_id, const gchar * name, uint32_t flags,
+		     uint64_t filesize, time_t modificationdate)
 {
-  enter_lock ("release: %s", path);
-  // Check cached files first
-  GSList *item;
-  item = g_slist_find_custom (myfiles, path, (GCompareFunc) strcmp);
+  IndexRecord record;
+  memset (&record, 0, sizeof (record));
+  record.id = id;
+  record.parent_id = parent_id;
+  record.name = names->len;
+  record.flags = flags;
+  record.filesize = filesize;
+  record.modificationdate = modificationdate;
+  g_string_append_len (names, name ? name : "", strlen (name ? name : "") + 1);
+  g_byte_array_append (records, (guint8 *) & record, sizeof (record));
+}
 
-  if (item != NULL)
+static void
+append_index_folders (GByteArray * records, GString * names,
+		      LIBMTP_folder_t * folder)
+{
+  for (; folder != NULL; folder = folder->sibling)
     {
-      if (strncmp ("/Playlists/", path, 11) == 0)
+      uint32_t flags = INDEX_FOLDER;
+      // Outside lazy mode and warm-up every folder is complete
+      if (!listing_on_demand ()
+	  || (listed_folders != NULL
+	      && g_hash_table_contains (listed_folders,
+					GUINT_TO_POINTER
+					(folder->folder_id))))
+	flags |= INDEX_LISTED;
+      append_index_record (records, names, folder->folder_id,
+			   folder->parent_id, folder->name, flags, 0, 0);
+      append_index_folders (records, names, folder->child);
+    }
+}
+
+static gchar *
+index_cache_file (int storageid)
+{
+  gchar *filename, *path;
+  filename = g_strdup_printf ("%s-%08x.index", index_cache_prefix,
+			      storageArea[storageid].storage->id);
+  path = g_build_filename (g_get_user_cache_dir (), "mtpfs", filename, NULL);
+  g_free (filename);
+  return path;
+}
+
+/* Write the folder tree and file list of every storage area to disk so the
+ * next mount can start from them */
+static void
+save_index_cache ()
+{
+  int i;
+  if (index_cache_prefix == NULL || files_changed)
+    return;
+  for (i = 0; i < 4; i++)
+    {
+      if (storageArea[i].storage == NULL || storageArea[i].folders_changed)
+	continue;
+
+      GByteArray *data = g_byte_array_new ();
+      GString *names = g_string_new ("");
+      IndexHeader header;
+      LIBMTP_file_t *file;
+      gchar *path;
+
+      append_index_folders (data, names, storageArea[i].folders);
+      for (file = files; file != NULL; file = file->next)
 	{
-	  save_playlist (path, fi);
-	  close (fi->fh);
-	  return_unlock (0);
+	  if (file->storage_id == storageArea[i].storage->id)
+	    append_index_record (data, names, file->item_id, file->parent_id,
+				 file->filename,
+				 file->filetype & INDEX_FILETYPE,
+				 file->filesize, file->modificationdate);
+	}
+
+      memset (&header, 0, sizeof (header));
+      memcpy (header.magic, INDEX_MAGIC, sizeof (header.magic));
+      header.version = INDEX_VERSION;
+      header.storage_id = storageArea[i].storage->id;
+      header.records = data->len / sizeof (IndexRecord);
+      header.flags = (storageArea[i].listed || !listing_on_demand ()) ?
+	INDEX_LISTED : 0;
+      header.strings = names->len;
+      g_byte_array_prepend (data, (guint8 *) & header, sizeof (header));
+      g_byte_array_append (data, (guint8 *) names->str, names->len);
+
+      path = index_cache_file (i);
+      gchar *dir = g_path_get_dirname (path);
+      g_mkdir_with_parents (dir, 0700);
+      g_free (dir);
+      if (!g_file_set_contents (path, (gchar *) data->data, data->len, NULL))
+	{
+	  DBG ("could not write %s", path);
 	}
       else
 	{
-	  //find parent id
-	  gchar *filename = g_strdup ("");
-	  gchar **fields;
-	  gchar *directory;
-	  directory = (gchar *) g_malloc (strlen (path) + 1);
-	  directory = strcpy (directory, "/");
-	  fields = g_strsplit (path, "/", -1);
-	  int i;
-	  int parent_id = 0;
-	  int storageid;
-	  storageid = find_storage (path);
-	  if (storageid < 0)
+	  DBG ("saved %d objects to %s", header.records, path);
+	}
+      g_free (path);
+      g_string_free (names, TRUE);
+      g_byte_array_free (data, TRUE);
+    }
+}
+
+/* Map the saved index of one storage area and rebuild its folder tree,
+ * adding its files to newfiles.  complete is cleared if any folder in it
+ * was never listed.  Returns FALSE if there is no usable saved index. */
+static gboolean
+load_storage_index (int storageid, LIBMTP_file_t ** newfiles,
+		    gboolean * complete)
+{
+  GMappedFile *mapped;
+  const IndexHeader *header;
+  const IndexRecord *records;
+  const gchar *names, *contents;
+  gsize length;
+  gchar *path;
+  uint32_t i;
+
+  path = index_cache_file (storageid);
+  mapped = g_mapped_file_new (path, FALSE, NULL);
+  g_free (path);
+  if (mapped == NULL)
+    return FALSE;
+
+  contents = g_mapped_file_get_contents (mapped);
+  length = g_mapped_file_get_length (mapped);
+  header = (const IndexHeader *) contents;
+  records = (const IndexRecord *) (contents + sizeof (IndexHeader));
+  names = (const gchar *) (records + (length >= sizeof (IndexHeader) ?
+				      header->records : 0));
+  if (length < sizeof (IndexHeader)
+      || memcmp (header->magic, INDEX_MAGIC, sizeof (header->magic)) != 0
+      || header->version != INDEX_VERSION
+      || header->storage_id != storageArea[storageid].storage->id
+      || header->strings == 0
+      || length != sizeof (IndexHeader) +
+      (gsize) header->records * sizeof (IndexRecord) + header->strings
+      || names[header->strings - 1] != '\0')
+    {
+      DBG ("ignoring saved index for storage %d", storageid);
+      g_mapped_file_unref (mapped);
+      return FALSE;
+    }
+
+  GHashTable *folders = g_hash_table_new (g_direct_hash, g_direct_equal);
+  LIBMTP_folder_t *root = NULL;
+  for (i = 0; i < header->records; i++)
+    {
+      const IndexRecord *record = &records[i];
+      const gchar *name = (record->name < header->strings) ?
+	names + record->name : "";
+      if (record->flags & INDEX_FOLDER)
+	{
+	  LIBMTP_folder_t *folder, *parent = NULL;
+	  if (record->parent_id != 0)
 	    {
-	      return_unlock (-ENOENT);
+	      parent = g_hash_table_lookup (folders,
+					    GUINT_TO_POINTER
+					    (record->parent_id));
+	      if (parent == NULL)
+		continue;
 	    }
-	  for (i = 0; fields[i] != NULL; i++)
+	  folder = LIBMTP_new_folder_t ();
+	  folder->folder_id = record->id;
+	  folder->parent_id = record->parent_id;
+	  folder->storage_id = header->storage_id;
+	  folder->name = g_strdup (name);
+	  if (parent == NULL)
 	    {
-	      if (strlen (fields[i]) > 0)
-		{
-		  if (fields[i + 1] == NULL)
-		    {
-		      gchar *tmp = g_strndup (directory,
-					      strlen (directory) - 1);
-		      parent_id =
-			lookup_folder_id (storageArea
-					  [storageid].folders, tmp, NULL);
-		      g_free (tmp);
-		      if (parent_id < 0)
-			parent_id = 0;
-		      g_free (filename);
-		      filename = g_strdup (fields[i]);
-		    }
-		  else
-		    {
-		      directory = strcat (directory, fields[i]);
-		      directory = strcat (directory, "/");
-		    }
-		}
+	      folder->sibling = root;
+	      root = folder;
+	    }
+	  else
+	    {
+	      folder->sibling = parent->child;
+	      parent->child = folder;
 	    }
-	  DBG ("%s:%s:%d", filename, directory, parent_id);
+	  g_hash_table_insert (folders, GUINT_TO_POINTER (record->id),
+			       folder);
+	  if (record->flags & INDEX_LISTED)
+	    g_hash_table_add (listed_folders, GUINT_TO_POINTER (record->id));
+	  else
+	    *complete = FALSE;
+	}
+      else
+	{
+	  LIBMTP_file_t *file;
+	  file = LIBMTP_new_file_t ();
+	  file->item_id = record->id;
+	  file->parent_id = record->parent_id;
+	  file->storage_id = header->storage_id;
+	  file->filename = g_strdup (name);
+	  file->filesize = record->filesize;
+	  file->modificationdate = (time_t) record->modificationdate;
+	  file->filetype = record->flags & INDEX_FILETYPE;
+	  file->next = *newfiles;
+	  *newfiles = file;
+	}
+    }
+  g_hash_table_destroy (folders);
+
+  if (storageArea[storageid].folders)
+    LIBMTP_destroy_folder_t (storageArea[storageid].folders);
+  storageArea[storageid].folders = root;
+  storageArea[storageid].folders_changed = FALSE;
+  storageArea[storageid].listed = (header->flags & INDEX_LISTED) != 0;
+  if (!storageArea[storageid].listed)
+    *complete = FALSE;
+  DBG ("loaded %d objects for storage %d", header->records, storageid);
+  g_mapped_file_unref (mapped);
+  return TRUE;
+}
 
-	  struct stat st;
-	  uint64_t filesize;
-	  fstat (fi->fh, &st);
-	  filesize = (uint64_t) st.st_size;
-
-	  // Setup file
-	  int ret;
-	  LIBMTP_filetype_t filetype;
-	  filetype = find_filetype (filename);
-#ifdef USEMAD
-	  if (filetype == LIBMTP_FILETYPE_MP3)
+/* Start from the index saved at the last unmount, if there is one for
+ * every storage area.  complete is cleared if it came from a lazy
+ * session or an unfinished warm-up.  Returns TRUE if it was loaded. */
+static gboolean
+load_index_cache (gboolean * complete)
+{
+  LIBMTP_file_t *newfiles = NULL;
+  int i;
+  if (index_cache_prefix == NULL)
+    return FALSE;
+  if (listed_folders == NULL)
+    listed_folders = g_hash_table_new (g_direct_hash, g_direct_equal);
+  for (i = 0; i < 4; i++)
+    {
+      if (storageArea[i].storage != NULL
+	  && !load_storage_index (i, &newfiles, complete))
+	{
+	  // All or nothing, fetch everything from the device instead
+	  int j;
+	  for (j = 0; j < i; j++)
 	    {
-	      LIBMTP_track_t *genfile;
-	      genfile = LIBMTP_new_track_t ();
-	      gint songlen;
-	      struct id3_file *id3_fh;
-	      struct id3_tag *tag;
-	      gchar *tracknum;
-
-	      id3_fh = id3_file_fdopen (fi->fh, ID3_FILE_MODE_READONLY);
-	      tag = id3_file_tag (id3_fh);
-
-	      genfile->artist = getArtist (tag);
-	      genfile->title = getTitle (tag);
-	      genfile->album = getAlbum (tag);
-	      genfile->genre = getGenre (tag);
-	      genfile->date = getYear (tag);
-	      genfile->usecount = 0;
-	      genfile->parent_id = (uint32_t) parent_id;
-	      genfile->storage_id = storageArea[storageid].storage->id;
-
-	      /* If there is a songlength tag it will take
-	       * precedence over any length calculated from
-	       * the bitrate and filesize */
-	      songlen = getSonglen (tag);
-	      if (songlen > 0)
-		{
-		  genfile->duration = songlen * 1000;
-		}
-	      else
-		{
-		  genfile->duration = (uint16_t) calc_length (fi->fh) * 1000;
-		  //genfile->duration = 293000;
-		}
+	      if (storageArea[j].folders)
+		LIBMTP_destroy_folder_t (storageArea[j].folders);
+	      storageArea[j].folders = NULL;
+	      storageArea[j].folders_changed = TRUE;
+	      storageArea[j].listed = FALSE;
+	    }
+	  free_files (newfiles);
+	  g_hash_table_remove_all (listed_folders);
+	  return FALSE;
+	}
+    }
+  if (files)
+    free_files (files);
+  g_slist_free (lostfiles);
+  lostfiles = NULL;
+  files = newfiles;
+  forget_file_links ();
+  files_changed = FALSE;
+  index_changed = TRUE;
+  return TRUE;
+}
 
-	      tracknum = getTracknum (tag);
-	      if (tracknum != NULL)
-		{
-		  genfile->tracknumber = strtoul (tracknum, NULL, 10);
-		}
-	      else
-		{
-		  genfile->tracknumber = 0;
-		}
-	      g_free (tracknum);
-
-	      // Compensate for missing tag information
-	      if (!genfile->artist)
-		genfile->artist = g_strdup ("<Unknown>");
-	      if (!genfile->title)
-		genfile->title = g_strdup ("<Unknown>");
-	      if (!genfile->album)
-		genfile->album = g_strdup ("<Unknown>");
-	      if (!genfile->genre)
-		genfile->genre = g_strdup ("<Unknown>");
-
-	      genfile->filesize = filesize;
-	      genfile->filetype = filetype;
-	      genfile->filename = g_strdup (filename);
-	      //title,artist,genre,album,date,tracknumber,duration,samplerate,nochannels,wavecodec,bitrate,bitratetype,rating,usecount
-	      //DBG("%d:%d:%d",fi->fh,genfile->duration,genfile->filesize);
-	      ret =
-		LIBMTP_Send_Track_From_File_Descriptor
-		(device, fi->fh, genfile, NULL, NULL);
-	      id3_file_close (id3_fh);
-	      LIBMTP_destroy_track_t (genfile);
-	      DBG ("Sent TRACK %s", path);
+static gint
+compare_storage_use (gconstpointer a, gconstpointer b)
+{
+  const LIBMTP_devicestorage_t *sa = storageArea[*(const int *) a].storage;
+  const LIBMTP_devicestorage_t *sb = storageArea[*(const int *) b].storage;
+  uint64_t used_a = sa->MaxCapacity - sa->FreeSpaceInBytes;
+  uint64_t used_b = sb->MaxCapacity - sb->FreeSpaceInBytes;
+  return (used_a < used_b) - (used_a > used_b);
+}
+
+/* Background walk over every folder of the device, one storage area at a
+ * time with the fullest first.  The device lock is taken per folder, so
+ * requests from the mount run in between and see each folder as soon as it
+ * has been fetched.
+ *
+ * When warming up, folders not yet listed are fetched and warming_up is
+ * cleared at the end.  When revalidating an index loaded from disk, every
+ * folder is fetched again and reconciled; in lazy mode only folders that
+ * had been listed are visited. */
+static gpointer
+walk_folders (gpointer data)
+{
+  gboolean revalidate = GPOINTER_TO_INT (data);
+  int order[4], count = 0, n;
+  for (n = 0; n < 4; n++)
+    {
+      if (storageArea[n].storage != NULL)
+	order[count++] = n;
+    }
+  qsort (order, count, sizeof (int), compare_storage_use);
+
+  for (n = 0; n < count && !g_atomic_int_get (&index_walker_stop); n++)
+    {
+      GQueue queue = G_QUEUE_INIT;
+      int storageid = order[n];
+      g_queue_push_tail (&queue, GUINT_TO_POINTER (0));
+      while (!g_queue_is_empty (&queue))
+	{
+	  uint32_t folder_id = GPOINTER_TO_UINT (g_queue_pop_head (&queue));
+	  GArray *children;
+	  int i;
+	  if (g_atomic_int_get (&index_walker_stop))
+	    continue;
+
+	  enter_lock ("walk %d:%d", storageid, folder_id);
+	  check_index ();
+	  if (revalidate)
+	    {
+	      if (!lazy_listing || folder_listed (storageid, folder_id))
+		sync_folder (storageid, folder_id);
 	    }
 	  else
 	    {
-#endif
-	      LIBMTP_file_t *genfile;
-	      genfile = LIBMTP_new_file_t ();
-	      genfile->filesize = filesize;
-	      genfile->filetype = filetype;
-	      genfile->filename = g_strdup (filename);
-	      genfile->parent_id = (uint32_t) parent_id;
-	      genfile->storage_id = storageArea[storageid].storage->id;
-
-	      ret =
-		LIBMTP_Send_File_From_File_Descriptor
-		(device, fi->fh, genfile, NULL, NULL);
-	      LIBMTP_destroy_file_t (genfile);
-	      DBG ("Sent FILE %s", path);
-#ifdef USEMAD
+	      list_folder (storageid, folder_id);
 	    }
-#endif
-	  if (ret == 0)
+	  children = find_children (folder_id, storageid);
+	  for (i = 0; children != NULL && i < children->len; i++)
+	    {
+	      uint32_t id = g_array_index (children, uint32_t, i);
+	      MTPObject *child;
+	      child = g_hash_table_lookup (object_index,
+					   GUINT_TO_POINTER (id));
+	      if (child != NULL && child->folder != NULL
+		  && (!lazy_listing || folder_listed (storageid, id)))
+		g_queue_push_tail (&queue, GUINT_TO_POINTER (id));
+	    }
+	  // Rebuilds are limited to one a second; in between the snapshot
+	  // is withdrawn rather than left stale
+	  publish_snapshot ();
+	  g_mutex_unlock (&device_lock);
+	}
+    }
+
+  enter_lock ("walk finished");
+  if (warming_up && !g_atomic_int_get (&index_walker_stop))
+    {
+      warming_up = FALSE;
+      index_version++;
+    }
+  return_unlock (NULL);
+}
+
+static void
+free_playlist_render (PlaylistRender * render)
+{
+  g_free (render->body);
+  g_free (render);
+}
+
+static void
+free_track_path (TrackPath * cached)
+{
+  g_array_free (cached->ids, TRUE);
+  g_ptr_array_free (cached->names, TRUE);
+  g_free (cached);
+}
+
+/* Ask the device for the folders of a track that is not in the index
+ * yet, one by one up to one that is, or to the root of the storage */
+static TrackPath *
+find_track_path (uint32_t track_id)
+{
+  LIBMTP_file_t *file;
+  TrackPath *cached;
+  uint32_t parent_id;
+  int depth;
+
+  cached = g_new0 (TrackPath, 1);
+  cached->ids = g_array_new (FALSE, FALSE, sizeof (uint32_t));
+  cached->names = g_ptr_array_new_with_free_func (g_free);
+  cached->storageid = -1;
+  cached->playlists_version = playlists_version;
+
+  file = LIBMTP_Get_Filemetadata (device, track_id);
+  if (file == NULL || file->filename == NULL)
+    {
+      if (file != NULL)
+	LIBMTP_destroy_file_t (file);
+      return cached;
+    }
+  g_array_append_val (cached->ids, track_id);
+  g_ptr_array_add (cached->names, g_strdup (file->filename));
+  parent_id = file->parent_id;
+  cached->storageid = find_storage_by_id (file->storage_id);
+  LIBMTP_destroy_file_t (file);
+
+  for (depth = 0; depth < 64 && cached->storageid >= 0; depth++)
+    {
+      MTPObject *parent;
+      parent = g_hash_table_lookup (object_index,
+				    GUINT_TO_POINTER (parent_id));
+      if (parent_id == 0 || (parent != NULL && parent->path != NULL))
+	{
+	  cached->base = parent_id;
+	  return cached;
+	}
+      file = LIBMTP_Get_Filemetadata (device, parent_id);
+      if (file == NULL || file->filename == NULL)
+	{
+	  if (file != NULL)
+	    LIBMTP_destroy_file_t (file);
+	  break;
+	}
+      g_array_append_val (cached->ids, parent_id);
+      g_ptr_array_add (cached->names, g_strdup (file->filename));
+      parent_id = file->parent_id;
+      LIBMTP_destroy_file_t (file);
+    }
+  // Not found: forget what was gathered
+  g_array_set_size (cached->ids, 0);
+  g_ptr_array_set_size (cached->names, 0);
+  return cached;
+}
+
+/* Join the names of a track and its folders onto the nearest of them that
+ * is in the index now, which may have been listed or renamed since the
+ * device was asked.  Returns NULL if the path cannot be made any more. */
+static gchar *
+join_track_path (TrackPath * cached)
+{
+  GString *joined;
+  int i, from;
+
+  if (cached->names->len == 0)
+    return NULL;
+  joined = NULL;
+  for (from = 0; from < cached->ids->len && joined == NULL; from++)
+    {
+      MTPObject *object;
+      object = g_hash_table_lookup (object_index,
+				    GUINT_TO_POINTER (g_array_index
+						      (cached->ids, uint32_t,
+						       from)));
+      if (object != NULL && object->path != NULL)
+	joined = g_string_new (object->path);
+    }
+  if (joined != NULL)
+    {
+      // The names below the folder found
+      from -= 2;
+    }
+  else if (cached->base == 0)
+    {
+      if (cached->storageid < 0
+	  || storageArea[cached->storageid].storage == NULL)
+	return NULL;
+      joined = g_string_new ("/");
+      g_string_append (joined,
+		       storageArea[cached->storageid].storage->
+		       StorageDescription);
+      from = cached->names->len - 1;
+    }
+  else
+    {
+      MTPObject *base;
+      base = g_hash_table_lookup (object_index,
+				  GUINT_TO_POINTER (cached->base));
+      if (base == NULL || base->path == NULL)
+	return NULL;
+      joined = g_string_new (base->path);
+      from = cached->names->len - 1;
+    }
+  for (i = from; i >= 0; i--)
+    {
+      g_string_append_c (joined, '/');
+      g_string_append (joined, g_ptr_array_index (cached->names, i));
+    }
+  return g_string_free (joined, FALSE);
+}
+
+/* Mount path of a track that is not in the index yet.  What the device
+ * says about its folders is kept across renders, so listing more folders
+ * costs no further round trips; tracks it knows nothing of are asked for
+ * again once the playlists are reloaded. */
+static gchar *
+track_path (uint32_t track_id)
+{
+  TrackPath *cached;
+  gchar *path;
+
+  if (track_paths == NULL)
+    track_paths = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+					 NULL,
+					 (GDestroyNotify) free_track_path);
+  cached = g_hash_table_lookup (track_paths, GUINT_TO_POINTER (track_id));
+  if (cached != NULL)
+    {
+      if (cached->names->len == 0
+	  && cached->playlists_version == playlists_version)
+	return NULL;
+      path = join_track_path (cached);
+      if (path != NULL)
+	return path;
+    }
+  cached = find_track_path (track_id);
+  g_hash_table_replace (track_paths, GUINT_TO_POINTER (track_id), cached);
+  return join_track_path (cached);
+}
+
+/* Render a playlist as m3u text, one mount path per track, from the index.
+ * The text is kept until the playlists are refreshed or the index changes,
+ * so getattr and open of a playlist cost no device round trips. */
+static PlaylistRender *
+render_playlist (LIBMTP_playlist_t * playlist)
+{
+  PlaylistRender *render;
+  GString *body;
+  int i;
+
+  check_index ();
+  if (playlist_renders == NULL)
+    playlist_renders = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+					      NULL,
+					      (GDestroyNotify)
+					      free_playlist_render);
+  render = g_hash_table_lookup (playlist_renders,
+				GUINT_TO_POINTER (playlist->playlist_id));
+  if (render != NULL && render->playlists_version == playlists_version
+      && render->index_version == index_version)
+    return render;
+
+  DBG ("Rendering playlist %s", playlist->name);
+  body = g_string_new (NULL);
+  for (i = 0; i < playlist->no_tracks; i++)
+    {
+      MTPObject *object;
+      object = g_hash_table_lookup (object_index,
+				    GUINT_TO_POINTER (playlist->tracks[i]));
+      if (object != NULL && object->path != NULL)
+	{
+	  g_string_append (body, object->path);
+	  g_string_append_c (body, '\n');
+	}
+      else
+	{
+	  gchar *path = track_path (playlist->tracks[i]);
+	  if (path != NULL)
 	    {
-	      DBG ("Sent %s", path);
+	      g_string_append (body, path);
+	      g_string_append_c (body, '\n');
+	      g_free (path);
 	    }
 	  else
 	    {
-	      DBG ("Problem sending %s - %d", path, ret);
+	      // Kept by id, so saving the text back does not drop it
+	      DBG ("no path for track %d", playlist->tracks[i]);
+	      g_string_append_printf (body, PLAYLIST_TRACK_ID "%u\n",
+				      playlist->tracks[i]);
 	    }
-	  // Cleanup
-	  if (item && item->data)
-	    g_free (item->data);
-	  myfiles = g_slist_remove (myfiles, item->data);
-	  g_strfreev (fields);
-	  g_free (filename);
-	  g_free (directory);
-	  close (fi->fh);
-	  // Refresh filelist
-	  files_changed = TRUE;
-	  return_unlock (ret);
 	}
     }
-  close (fi->fh);
-  return_unlock (0);
+
+  render = g_new0 (PlaylistRender, 1);
+  render->playlists_version = playlists_version;
+  render->index_version = index_version;
+  render->length = body->len;
+  render->body = g_string_free (body, FALSE);
+  g_hash_table_insert (playlist_renders,
+		       GUINT_TO_POINTER (playlist->playlist_id), render);
+  return render;
 }
 
-void
-mtpfs_destroy (void *buf)
+/* Resolve the lines of an m3u file to track ids, in one pass against the
+ * path index.  Lines that do not name a file on the device are reported
+ * and left out. */
+static GArray *
+resolve_playlist (const gchar * path, int fd)
 {
-  enter_lock ("destroy");
-  if (files)
-    free_files (files);
-  int i;
-  for (i = 0; i < 4; i++)
+  GArray *tracks;
+  FILE *file;
+  gchar line[PATH_MAX];
+  int line_number = 0;
+  int copy;
+
+  tracks = g_array_new (FALSE, FALSE, sizeof (uint32_t));
+  copy = dup (fd);
+  if (copy == -1)
+    return tracks;
+  file = fdopen (copy, "r");
+  if (file == NULL)
     {
-      if (storageArea[i].folders)
-	LIBMTP_destroy_folder_t (storageArea[i].folders);
+      close (copy);
+      return tracks;
     }
-  if (playlists)
-    free_playlists (playlists);
-  if (device)
-    LIBMTP_Release_Device (device);
-  return_unlock ();
+  rewind (file);
+  check_index ();
+  while (fgets (line, sizeof (line), file) != NULL)
+    {
+      MTPPath mp;
+      MTPObject *object = NULL;
+      line_number++;
+      g_strstrip (line);
+      if (g_str_has_prefix (line, PLAYLIST_TRACK_ID))
+	{
+	  uint32_t id = strtoul (line + strlen (PLAYLIST_TRACK_ID), NULL, 10);
+	  if (id != 0)
+	    g_array_append_val (tracks, id);
+	  continue;
+	}
+      if (line[0] == '\0' || line[0] == '#')
+	continue;
+      if (split_path (&mp, line))
+	object = resolve_path (&mp);
+      if (object == NULL || object->file == NULL)
+	{
+	  g_warning ("%s line %d: no such file: %s", path, line_number, line);
+	  continue;
+	}
+      g_array_append_val (tracks, object->id);
+    }
+  fclose (file);
+  return tracks;
 }
 
-static int
-mtpfs_readdir (const gchar * path, void *buf, fuse_fill_dir_t filler,
-	       off_t offset, struct fuse_file_info *fi)
+int
+save_playlist (const char *path, int fd)
 {
-  enter_lock ("readdir %s", path);
-  LIBMTP_folder_t *folder;
+  DBG ("save_playlist");
+  int ret = 0;
 
-  // Add common entries
-  filler (buf, ".", NULL, 0);
-  filler (buf, "..", NULL, 0);
+  LIBMTP_playlist_t *playlist;
+  GArray *tracks;
+  const gchar *name;
+
+  name = strrchr (path, '/') + 1;
+  playlist = LIBMTP_new_playlist_t ();
+  playlist->name = g_strndup (name, strlen (name) - 4);
+  DBG ("Adding:%s", playlist->name);
+
+  tracks = resolve_playlist (path, fd);
+  playlist->no_tracks = tracks->len;
+  playlist->tracks = (uint32_t *) g_array_free (tracks, FALSE);
+  DBG ("Total:%d", playlist->no_tracks);
+
+  LIBMTP_playlist_t *tmp_playlist;
+  check_playlists ();
+  for (tmp_playlist = playlists; tmp_playlist != NULL;
+       tmp_playlist = tmp_playlist->next)
+    {
+      if (g_ascii_strcasecmp (tmp_playlist->name, playlist->name) == 0)
+	{
+	  playlist->playlist_id = tmp_playlist->playlist_id;
+	  break;
+	}
+    }
+
+  if (playlist->playlist_id > 0)
+    {
+      DBG ("Update playlist %d", playlist->playlist_id);
+      ret = LIBMTP_Update_Playlist (device, playlist);
+    }
+  else
+    {
+      DBG ("New playlist");
+      ret = LIBMTP_Create_New_Playlist (device, playlist);
+    }
+  if (ret != 0)
+    {
+      g_warning ("could not save playlist %s", path);
+      LIBMTP_Dump_Errorstack (device);
+      LIBMTP_Clear_Errorstack (device);
+      ret = -EIO;
+    }
+  LIBMTP_destroy_playlist_t (playlist);
+  playlists_changed = TRUE;
+  return ret;
+}
+
+/* Find the file type based on extension */
+static LIBMTP_filetype_t
+find_filetype (const gchar * filename)
+{
+  DBG ("find_filetype");
+  const gchar *ptype;
+  ptype = strrchr (filename, '.');
+  ptype = (ptype != NULL) ? ptype + 1 : filename;
+  LIBMTP_filetype_t filetype;
+
+  // This need to be kept constantly updated as new file types arrive.
+  if (!g_ascii_strncasecmp (ptype, "wav", 3))
+    {
+      filetype = LIBMTP_FILETYPE_WAV;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "mp3", 3))
+    {
+      filetype = LIBMTP_FILETYPE_MP3;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "wma", 3))
+    {
+      filetype = LIBMTP_FILETYPE_WMA;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "ogg", 3))
+    {
+      filetype = LIBMTP_FILETYPE_OGG;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "aa", 2))
+    {
+      filetype = LIBMTP_FILETYPE_AUDIBLE;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "mp4", 3))
+    {
+      filetype = LIBMTP_FILETYPE_MP4;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "wmv", 3))
+    {
+      filetype = LIBMTP_FILETYPE_WMV;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "avi", 3))
+    {
+      filetype = LIBMTP_FILETYPE_AVI;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "mpeg", 4)
+	   || !g_ascii_strncasecmp (ptype, "mpg", 3))
+    {
+      filetype = LIBMTP_FILETYPE_MPEG;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "asf", 3))
+    {
+      filetype = LIBMTP_FILETYPE_ASF;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "qt", 2)
+	   || !g_ascii_strncasecmp (ptype, "mov", 3))
+    {
+      filetype = LIBMTP_FILETYPE_QT;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "wma", 3))
+    {
+      filetype = LIBMTP_FILETYPE_WMA;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "jpg", 3)
+	   || !g_ascii_strncasecmp (ptype, "jpeg", 4))
+    {
+      filetype = LIBMTP_FILETYPE_JPEG;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "jfif", 4))
+    {
+      filetype = LIBMTP_FILETYPE_JFIF;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "tif", 3)
+	   || !g_ascii_strncasecmp (ptype, "tiff", 4))
+    {
+      filetype = LIBMTP_FILETYPE_TIFF;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "bmp", 3))
+    {
+      filetype = LIBMTP_FILETYPE_BMP;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "gif", 3))
+    {
+      filetype = LIBMTP_FILETYPE_GIF;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "pic", 3)
+	   || !g_ascii_strncasecmp (ptype, "pict", 4))
+    {
+      filetype = LIBMTP_FILETYPE_PICT;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "png", 3))
+    {
+      filetype = LIBMTP_FILETYPE_PNG;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "wmf", 3))
+    {
+      filetype = LIBMTP_FILETYPE_WINDOWSIMAGEFORMAT;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "ics", 3))
+    {
+      filetype = LIBMTP_FILETYPE_VCALENDAR2;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "exe", 3)
+	   || !g_ascii_strncasecmp (ptype, "com", 3)
+	   || !g_ascii_strncasecmp (ptype, "bat", 3)
+	   || !g_ascii_strncasecmp (ptype, "dll", 3)
+	   || !g_ascii_strncasecmp (ptype, "sys", 3))
+    {
+      filetype = LIBMTP_FILETYPE_WINEXEC;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "txt", 3))
+    {
+      filetype = LIBMTP_FILETYPE_TEXT;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "htm", 3)
+	   || !g_ascii_strncasecmp (ptype, "html", 4))
+    {
+      filetype = LIBMTP_FILETYPE_HTML;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "bin", 3))
+    {
+      filetype = LIBMTP_FILETYPE_FIRMWARE;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "aac", 3))
+    {
+      filetype = LIBMTP_FILETYPE_AAC;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "flac", 4)
+	   || !g_ascii_strncasecmp (ptype, "fla", 3))
+    {
+      filetype = LIBMTP_FILETYPE_FLAC;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "mp2", 3))
+    {
+      filetype = LIBMTP_FILETYPE_MP2;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "m4a", 3))
+    {
+      filetype = LIBMTP_FILETYPE_M4A;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "doc", 3))
+    {
+      filetype = LIBMTP_FILETYPE_DOC;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "xml", 3))
+    {
+      filetype = LIBMTP_FILETYPE_XML;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "xls", 3))
+    {
+      filetype = LIBMTP_FILETYPE_XLS;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "ppt", 3))
+    {
+      filetype = LIBMTP_FILETYPE_PPT;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "mht", 3))
+    {
+      filetype = LIBMTP_FILETYPE_MHT;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "jp2", 3))
+    {
+      filetype = LIBMTP_FILETYPE_JP2;
+    }
+  else if (!g_ascii_strncasecmp (ptype, "jpx", 3))
+    {
+      filetype = LIBMTP_FILETYPE_JPX;
+    }
+  else
+    {
+      DBG ("Sorry, file type \"%s\" is not yet supported", ptype);
+      DBG ("Tagging as unknown file type.");
+      filetype = LIBMTP_FILETYPE_UNKNOWN;
+    }
+  return filetype;
+}
+
+static int
+find_storage (const gchar * path)
+{
+  int i;
+  DBG ("find_storage:%s", path);
+  for (i = 0; i < 4; i++)
+    {
+      if (storageArea[i].storage != NULL)
+	{
+	  int maxlen = strlen (storageArea[i].storage->StorageDescription);
+	  if (strlen (path + 1) < maxlen)
+	    maxlen = strlen (path + 1);
+	  if (strncmp
+	      (storageArea[i].storage->StorageDescription,
+	       path + 1, maxlen) == 0)
+	    {
+	      DBG ("%s found as %d",
+		   storageArea[i].storage->StorageDescription, i);
+	      return i;
+	    }
+	}
+    }
+  DBG ("could not find storage for %s", path);
+  return -1;
+}
+
+/* Returns the folder id for path, -2 for the root of a storage area or
+ * -1 if path is not a folder */
+static int
+lookup_folder_id (const gchar * path)
+{
+  DBG ("lookup_folder_id %s", path);
+  MTPObject *object;
+  if (g_strrstr (path + 1, "/") == NULL)
+    {
+      DBG ("Storage dir");
+      return -2;
+    }
+  object = lookup_path (path);
+  if (object == NULL || object->folder == NULL)
+    return -1;
+  return object->id;
+}
+
+/* Whether path names the m3u file of a playlist, /Playlists/<name>.m3u */
+static gboolean
+is_playlist_path (const gchar * path, const LIBMTP_playlist_t * playlist)
+{
+  gsize length = strlen (playlist->name);
+  return g_ascii_strncasecmp (path, "/Playlists/", 11) == 0
+    && g_ascii_strncasecmp (path + 11, playlist->name, length) == 0
+    && g_ascii_strcasecmp (path + 11 + length, ".m3u") == 0;
+}
+
+static int
+parse_path (const gchar * path)
+{
+  DBG ("parse_path:%s", path);
+  int res;
+  // Check cached files first
+  GSList *item;
+  item = g_slist_find_custom (myfiles, path, (GCompareFunc) strcmp);
+  if (item != NULL)
+    return 0;
+
+  // Check Playlists
+  if (strncmp ("/Playlists", path, 10) == 0)
+    {
+      LIBMTP_playlist_t *playlist;
+
+      res = -ENOENT;
+      check_playlists ();
+      playlist = playlists;
+      while (playlist != NULL)
+	{
+	  if (is_playlist_path (path, playlist))
+	    {
+	      res = playlist->playlist_id;
+	      break;
+	    }
+	  playlist = playlist->next;
+	}
+      return res;
+    }
+  // Check lost+found
+  if (strncmp ("/lost+found", path, 11) == 0)
+    {
+      GSList *item;
+      const gchar *filename = strrchr (path, '/') + 1;
+
+      check_index ();
+      res = -ENOENT;
+      for (item = lostfiles; item != NULL; item = g_slist_next (item))
+	{
+	  LIBMTP_file_t *file = (LIBMTP_file_t *) item->data;
+
+	  if (strcmp (file->filename, filename) == 0)
+	    {
+	      res = file->item_id;
+	      break;
+	    }
+	}
+      return res;
+    }
+  // Check device
+  MTPObject *object;
+  int storageid;
+  storageid = find_storage (path);
+  if (storageid < 0)
+    {
+      return -ENOENT;
+    }
+  if (g_strrstr (path + 1, "/") == NULL)
+    {
+      res = -2;
+    }
+  else
+    {
+      object = lookup_path (path);
+      res = (object != NULL) ? object->id : -ENOENT;
+    }
+  DBG ("parse_path exiting:%s - %d", path, res);
+  return res;
+}
+
+static int
+mtpfs_release (const char *path, struct fuse_file_info *fi)
+{
+  MTPHandle *handle = HANDLE (fi);
+  int upload_ret = 0;
+  // The send holds the device until it has every byte
+  if (handle->upload != NULL)
+    upload_ret = finish_upload (handle->upload);
+  flush_edit (handle);
+  // A replacement keeps whatever of the old object was not overwritten
+  if (handle->replace_id != 0 && handle->dirty && !handle->complete)
+    {
+      g_mutex_lock (&handle->lock);
+      if (!handle->complete)
+	upload_ret = fetch_old_contents (handle);
+      g_mutex_unlock (&handle->lock);
+    }
+  enter_lock ("release: %s", path);
+  if (handle->editing)
+    {
+      int ret = end_edit (handle);
+      close_handle (handle);
+      return_unlock (ret);
+    }
+  // Check cached files first
+  GSList *item;
+  item = g_slist_find_custom (myfiles, path, (GCompareFunc) strcmp);
+
+  if (item != NULL)
+    {
+      if (strncmp ("/Playlists/", path, 11) == 0)
+	{
+	  int ret = 0;
+	  // Normally saved by flush, where an error can be returned
+	  if (!handle->saved)
+	    ret = save_playlist (path, handle->fd);
+	  g_free (item->data);
+	  myfiles = g_slist_delete_link (myfiles, item);
+	  myfiles_version++;
+	  close_handle (handle);
+	  return_unlock (ret);
+	}
+      else if (handle->upload != NULL)
+	{
+	  // Already sent while it was written
+	  DBG ("Streamed %s - %d", path, upload_ret);
+	  g_free (item->data);
+	  myfiles = g_slist_remove (myfiles, item->data);
+	  myfiles_version++;
+	  close_handle (handle);
+	  return_unlock (upload_ret);
+	}
+      else
+	{
+	  // Sent in the background; flush and fsync wait for it
+	  queue_upload (path, handle);
+	  close_handle (handle);
+	  return_unlock (0);
+	}
+    }
+  if (handle->replace_id != 0 && handle->dirty)
+    {
+      if (upload_ret == 0)
+	queue_upload (path, handle);
+      close_handle (handle);
+      return_unlock (upload_ret);
+    }
+  close_handle (handle);
+  return_unlock (0);
+}
+
+void
+mtpfs_destroy (void *buf)
+{
+  drain_uploads ();
+  if (staged_peak > 0)
+    g_message ("staging peaked at %" G_GUINT64_FORMAT " MB",
+	       staged_peak >> 20);
+  if (index_walker)
+    {
+      g_atomic_int_set (&index_walker_stop, 1);
+      g_thread_join (index_walker);
+    }
+  if (readahead_pool)
+    {
+      g_atomic_int_set (&readahead_stop, 1);
+      g_thread_pool_free (readahead_pool, FALSE, TRUE);
+    }
+  g_mutex_lock (&download_lock);
+  downloads_stop = TRUE;
+  while (downloads_running > 0)
+    g_cond_wait (&download_cond, &download_lock);
+  g_mutex_unlock (&download_lock);
+  enter_lock ("destroy");
+  save_index_cache ();
+  if (path_index)
+    {
+      g_hash_table_destroy (negative_paths);
+      g_hash_table_destroy (path_index);
+      g_hash_table_destroy (object_index);
+      path_index = NULL;
+    }
+  if (files)
+    free_files (files);
+  forget_file_links ();
+  int i;
+  for (i = 0; i < 4; i++)
+    {
+      if (storageArea[i].folders)
+	LIBMTP_destroy_folder_t (storageArea[i].folders);
+      if (storageArea[i].children)
+	g_array_free (storageArea[i].children, TRUE);
+    }
+  if (playlist_renders)
+    g_hash_table_destroy (playlist_renders);
+  if (track_paths)
+    g_hash_table_destroy (track_paths);
+  if (downloads)
+    g_hash_table_destroy (downloads);
+  if (chunk_cache)
+    {
+      // The list links live inside the chunks
+      g_queue_init (&chunk_lru);
+      g_hash_table_destroy (chunk_cache);
+    }
+  if (pending_chunks)
+    g_hash_table_destroy (pending_chunks);
+  if (playlists)
+    free_playlists (playlists);
+  if (device)
+    LIBMTP_Release_Device (device);
+  return_unlock ();
+}
+
+static int
+mtpfs_readdir (const gchar * path, void *buf, fuse_fill_dir_t filler,
+	       off_t offset, struct fuse_file_info *fi)
+{
+  if (snapshot_readdir (path, buf, filler) == 0)
+    return 0;
+
+  enter_lock ("readdir %s", path);
+
+  // Add common entries
+  filler (buf, ".", NULL, 0);
+  filler (buf, "..", NULL, 0);
+
+  // If in root directory
+  if (strcmp (path, "/") == 0)
+    {
+      filler (buf, "Playlists", NULL, 0);
+      check_index ();
+      if (lostfiles != NULL)
+	{
+	  filler (buf, "lost+found", NULL, 0);
+	}
+      LIBMTP_devicestorage_t *storage;
+      for (storage = device->storage; storage != 0; storage = storage->next)
+	{
+	  struct stat st;
+	  memset (&st, 0, sizeof (st));
+	  st.st_nlink = 2;
+	  st.st_ino = storage->id;
+	  st.st_mode = S_IFREG | 0555;
+	  gchar *name;
+	  filler (buf, storage->StorageDescription, &st, 0);
+	}
+      return_unlock (0);
+    }
+  // Are we looking at the playlists?
+  if (strncmp (path, "/Playlists", 10) == 0)
+    {
+      DBG ("Checking Playlists");
+      LIBMTP_playlist_t *playlist;
+      check_playlists ();
+      playlist = playlists;
+      while (playlist != NULL)
+	{
+	  struct stat st;
+	  memset (&st, 0, sizeof (st));
+	  st.st_ino = playlist->playlist_id;
+	  st.st_mode = S_IFREG | 0666;
+	  gchar name[PATH_MAX];
+	  g_snprintf (name, sizeof (name), "%s.m3u", playlist->name);
+	  DBG ("Playlist:%s", name);
+	  if (filler (buf, name, &st, 0))
+	    break;
+	  playlist = playlist->next;
+	}
+      return_unlock (0);
+    }
+  // Are we looking at lost+found dir?
+  if (strncmp (path, "/lost+found", 11) == 0)
+    {
+      check_index ();
+      GSList *item;
+
+      for (item = lostfiles; item != NULL; item = g_slist_next (item))
+	{
+	  LIBMTP_file_t *file = (LIBMTP_file_t *) item->data;
+
+	  struct stat st;
+	  memset (&st, 0, sizeof (st));
+	  st.st_ino = file->item_id;
+	  st.st_mode = S_IFREG | 0444;
+	  if (filler
+	      (buf,
+	       (file->filename ==
+		NULL ? "<mtpfs null>" : file->filename), &st, 0))
+	    break;
+	}
+      return_unlock (0);
+    }
+  // Get storage area
+  int i;
+  int storageid = -1;
+  storageid = find_storage (path);
+  if (storageid < 0)
+    {
+      return_unlock (-ENOENT);
+    }
+  // Get folder listing.
+  GArray *children;
+  check_index ();
+  if (g_strrstr (path + 1, "/") == NULL)
+    {
+      DBG ("Root of storage area");
+      list_folder (storageid, 0);
+      children = storageArea[storageid].children;
+    }
+  else
+    {
+      MTPObject *object;
+      object = lookup_path (path);
+      if (object == NULL || object->folder == NULL)
+	return_unlock (0);
+      list_object (object);
+      children = object->children;
+    }
+
+  DBG ("Listing %d entries", children->len);
+  for (i = 0; i < children->len; i++)
+    {
+      MTPObject *child;
+      child = g_hash_table_lookup (object_index,
+				   GUINT_TO_POINTER (g_array_index
+						     (children, uint32_t,
+						      i)));
+      if (child == NULL)
+	continue;
+      struct stat st;
+      memset (&st, 0, sizeof (st));
+      st.st_ino = child->id;
+      if (child->folder != NULL)
+	{
+	  DBG ("found folder: %s, id %d", child->folder->name, child->id);
+	  st.st_mode = S_IFDIR | 0777;
+	  if (filler (buf, child->folder->name, &st, 0))
+	    break;
+	}
+      else
+	{
+	  st.st_mode = S_IFREG | 0444;
+	  if (filler
+	      (buf,
+	       (child->file->filename ==
+		NULL ? "<mtpfs null>" : child->file->filename), &st, 0))
+	    break;
+	}
+    }
+  // Files not sent yet
+  GSList *item;
+  for (item = myfiles; item != NULL; item = item->next)
+    {
+      const gchar *name = strrchr (item->data, '/');
+      if (name - (gchar *) item->data != strlen (path)
+	  || g_ascii_strncasecmp (item->data, path, strlen (path)) != 0)
+	continue;
+      struct stat st;
+      memset (&st, 0, sizeof (st));
+      st.st_mode = S_IFREG | 0444;
+      if (filler (buf, name + 1, &st, 0))
+	break;
+    }
+  DBG ("readdir exit");
+  return_unlock (0);
+}
+
+static int
+mtpfs_getattr_real (const gchar * path, struct stat *stbuf)
+{
+  int ret = 0;
+  if (path == NULL)
+    return -ENOENT;
+  memset (stbuf, 0, sizeof (struct stat));
+
+  // Set uid/gid of file
+  struct fuse_context *fc;
+  fc = fuse_get_context ();
+  stbuf->st_uid = fc->uid;
+  stbuf->st_gid = fc->gid;
+  if (strcmp (path, "/") == 0)
+    {
+      stbuf->st_mode = S_IFDIR | 0777;
+      stbuf->st_nlink = 2;
+      return 0;
+    }
+  // Check cached files first (stuff that hasn't been written to dev yet)
+  GSList *item;
+  if (myfiles != NULL)
+    {
+      item = g_slist_find_custom (myfiles, path, (GCompareFunc) strcmp);
+      if (item != NULL)
+	{
+	  stbuf->st_mode = S_IFREG | 0777;
+	  stbuf->st_size = queued_size (path);
+	  stbuf->st_blocks = 2;
+	  stbuf->st_mtime = time (NULL);
+	  return 0;
+	}
+    }
+  // Special case directory 'Playlists', 'lost+found'
+  // Special case root directory items
+  if (g_strrstr (path + 1, "/") == NULL)
+    {
+      stbuf->st_mode = S_IFDIR | 0777;
+      stbuf->st_nlink = 2;
+      return 0;
+    }
+
+  int storageid;
+  storageid = find_storage (path);
+  if (storageid < 0)
+    {
+      return -ENOENT;
+    }
+
+  if (g_ascii_strncasecmp (path, "/Playlists", 10) == 0)
+    {
+      LIBMTP_playlist_t *playlist;
+      check_playlists ();
+      playlist = playlists;
+      while (playlist != NULL)
+	{
+	  if (is_playlist_path (path, playlist))
+	    {
+	      PlaylistRender *render = render_playlist (playlist);
+	      stbuf->st_mode = S_IFREG | 0777;
+	      stbuf->st_size = render->length;
+	      stbuf->st_blocks = 2;
+	      stbuf->st_mtime = time (NULL);
+	      return 0;
+	    }
+	  playlist = playlist->next;
+	}
+      return -ENOENT;
+    }
+
+  if (strncasecmp (path, "/lost+found", 11) == 0)
+    {
+      GSList *item;
+      int item_id = parse_path (path);
+      for (item = lostfiles; item != NULL; item = g_slist_next (item))
+	{
+	  LIBMTP_file_t *file = (LIBMTP_file_t *) item->data;
+
+	  if (item_id == file->item_id)
+	    {
+	      stbuf->st_ino = item_id;
+	      stbuf->st_size = file->filesize;
+	      stbuf->st_blocks = (file->filesize / 512) +
+		(file->filesize % 512 > 0 ? 1 : 0);
+	      stbuf->st_nlink = 1;
+	      stbuf->st_mode = S_IFREG | 0777;
+	      stbuf->st_mtime = file->modificationdate;
+	      return 0;
+	    }
+	}
+
+      return -ENOENT;
+    }
+
+  MTPObject *object;
+  object = lookup_path (path);
+  if (object == NULL)
+    {
+      ret = -ENOENT;
+    }
+  else if (object->folder != NULL)
+    {
+      // Must be a folder
+      stbuf->st_ino = object->id;
+      stbuf->st_mode = S_IFDIR | 0777;
+      stbuf->st_nlink = 2;
+    }
+  else
+    {
+      // Must be a file
+      LIBMTP_file_t *file = object->file;
+      uint64_t size = file->filesize;
+      DBG ("id:path=%d:%s", object->id, path);
+      pending_replacement (path, &size);
+      stbuf->st_ino = object->id;
+      stbuf->st_size = size;
+      stbuf->st_blocks = (size / 512) + (size % 512 > 0 ? 1 : 0);
+      stbuf->st_nlink = 1;
+      stbuf->st_mode = S_IFREG | 0777;
+      DBG ("time:%s", ctime (&(file->modificationdate)));
+      stbuf->st_mtime = file->modificationdate;
+      stbuf->st_ctime = file->modificationdate;
+      stbuf->st_atime = file->modificationdate;
+    }
+
+  return ret;
+}
+
+static int
+mtpfs_getattr (const gchar * path, struct stat *stbuf)
+{
+  int ret = snapshot_getattr (path, stbuf);
+  if (ret <= 0)
+    return ret;
+
+  enter_lock ("getattr %s", path);
+
+  ret = mtpfs_getattr_real (path, stbuf);
+
+  DBG ("getattr exit");
+  return_unlock (ret);
+}
+
+static int
+mtpfs_mknod (const gchar * path, mode_t mode, dev_t dev)
+{
+  wait_queued_upload (path);
+  enter_lock ("mknod %s", path);
+  int item_id = parse_path (path);
+  if (item_id > 0)
+    return_unlock (-EEXIST);
+  myfiles = g_slist_append (myfiles, (gpointer) (g_strdup (path)));
+  myfiles_version++;
+  DBG ("NEW FILE");
+  return_unlock (0);
+}
+
+/* Serve the reads of a file opened read-only from the chunk cache, if the
+ * device can send parts of objects */
+static RemoteFile *
+open_remote (uint32_t item_id)
+{
+  MTPObject *object;
+  RemoteFile *remote;
+  if (!partial_reads)
+    return NULL;
+  object = g_hash_table_lookup (object_index, GUINT_TO_POINTER (item_id));
+  if (object == NULL || object->file == NULL)
+    return NULL;
+  // Files that fit are copied whole into the content cache instead
+  if (content_cache_dir != NULL
+      && object->file->filesize <= content_cache_size / 4)
+    return NULL;
+  // Offsets past 4 GB need the 64-bit request, else copy it whole
+  if (object->file->filesize > G_MAXUINT32 && !partial_reads_64)
+    return NULL;
+  remote = g_new0 (RemoteFile, 1);
+  remote->id = item_id;
+  remote->size = object->file->filesize;
+  DBG ("reading %d from the device", item_id);
+  return remote;
+}
+
+static void
+free_chunk (Chunk * chunk)
+{
+  g_free (chunk->data);
+  g_free (chunk);
+}
+
+static void
+evict_chunk (Chunk * chunk)
+{
+  g_queue_unlink (&chunk_lru, &chunk->link);
+  g_hash_table_remove (chunk_cache, &chunk->key);
+}
+
+/* Forget the cached contents of an object that has changed or gone */
+static void
+drop_chunks (uint32_t id)
+{
+  GList *link, *next;
+  for (link = chunk_lru.head; link != NULL; link = next)
+    {
+      Chunk *chunk = link->data;
+      next = link->next;
+      if ((chunk->key >> 32) == id)
+	evict_chunk (chunk);
+    }
+}
+
+/* Get a chunk of a file, from the cache or else from the device.  Called
+ * with the device lock held. */
+static Chunk *
+fetch_chunk (uint32_t id, uint64_t size, guint64 number)
+{
+  Chunk *chunk;
+  guint64 key = CHUNK_KEY (id, number);
+  uint64_t offset = number * CHUNK_SIZE;
+  gsize done = 0;
+
+  if (chunk_cache == NULL)
+    chunk_cache = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+					 NULL, (GDestroyNotify) free_chunk);
+  chunk = g_hash_table_lookup (chunk_cache, &key);
+  if (chunk != NULL)
+    {
+      g_queue_unlink (&chunk_lru, &chunk->link);
+      g_queue_push_head_link (&chunk_lru, &chunk->link);
+      return chunk;
+    }
+
+  chunk = g_new0 (Chunk, 1);
+  chunk->key = key;
+  chunk->length = MIN (CHUNK_SIZE, size - offset);
+  chunk->data = g_malloc (chunk->length);
+  chunk->link.data = chunk;
+  while (done < chunk->length)
+    {
+      unsigned char *data = NULL;
+      unsigned int got = 0;
+      if (LIBMTP_GetPartialObject (device, id, offset + done,
+				   chunk->length - done, &data, &got) != 0
+	  || got == 0)
+	{
+	  DBG ("partial read of %d failed", id);
+	  LIBMTP_Dump_Errorstack (device);
+	  LIBMTP_Clear_Errorstack (device);
+	  free (data);
+	  free_chunk (chunk);
+	  return NULL;
+	}
+      got = MIN (got, chunk->length - done);
+      memcpy (chunk->data + done, data, got);
+      free (data);
+      done += got;
+    }
+
+  g_hash_table_insert (chunk_cache, &chunk->key, chunk);
+  g_queue_push_head_link (&chunk_lru, &chunk->link);
+  while (chunk_lru.length > CHUNK_CACHE_SIZE)
+    evict_chunk (chunk_lru.tail->data);
+  return chunk;
+}
+
+static void
+read_ahead (gpointer data, gpointer user_data)
+{
+  ChunkJob *job = data;
+  // Jobs left at unmount are only freed
+  if (g_atomic_int_get (&readahead_stop))
+    {
+      g_free (job);
+      return;
+    }
+  enter_lock ("read ahead %d:%d", (int) (job->key >> 32),
+	      (int) (job->key & 0xffffffff));
+  g_hash_table_remove (pending_chunks, &job->key);
+  fetch_chunk (job->key >> 32, job->size, job->key & 0xffffffff);
+  g_free (job);
+  return_unlock ();
+}
+
+/* Queue the chunks of the readahead window that are not cached yet */
+static void
+schedule_read_ahead (RemoteFile * remote)
+{
+  guint64 first = remote->next_offset / CHUNK_SIZE;
+  guint64 number;
+  if (readahead_pool == NULL)
+    {
+      readahead_pool = g_thread_pool_new (read_ahead, NULL, 1, FALSE, NULL);
+      pending_chunks = g_hash_table_new (g_int64_hash, g_int64_equal);
+    }
+  for (number = first;
+       number <= first + remote->window
+       && number * CHUNK_SIZE < remote->size; number++)
+    {
+      ChunkJob *job;
+      guint64 key = CHUNK_KEY (remote->id, number);
+      if ((chunk_cache != NULL && g_hash_table_contains (chunk_cache, &key))
+	  || g_hash_table_contains (pending_chunks, &key))
+	continue;
+      job = g_new (ChunkJob, 1);
+      job->key = key;
+      job->size = remote->size;
+      g_hash_table_add (pending_chunks, &job->key);
+      g_thread_pool_push (readahead_pool, job, NULL);
+    }
+}
+
+/* Serve a read from the chunk cache.  Reads that carry on where the last
+ * one stopped double the readahead window, any other read closes it, so
+ * seeks only fetch the chunks they touch. */
+static int
+read_remote (RemoteFile * remote, gchar * buf, size_t size, off_t offset)
+{
+  size_t done = 0;
+  if (offset >= remote->size)
+    return 0;
+  if (size > remote->size - offset)
+    size = remote->size - offset;
+  while (done < size)
+    {
+      Chunk *chunk;
+      uint64_t position = offset + done;
+      gsize from, count;
+      chunk = fetch_chunk (remote->id, remote->size, position / CHUNK_SIZE);
+      if (chunk == NULL)
+	return done > 0 ? done : -EIO;
+      from = position % CHUNK_SIZE;
+      count = MIN (chunk->length - from, size - done);
+      memcpy (buf + done, chunk->data + from, count);
+      done += count;
+    }
+
+  if (offset == remote->next_offset)
+    {
+      if (remote->window < READAHEAD_CHUNKS)
+	remote->window = (remote->window == 0) ? 1 : remote->window * 2;
+    }
+  else
+    {
+      remote->window = 0;
+    }
+  remote->next_offset = offset + done;
+  if (remote->window > 0)
+    schedule_read_ahead (remote);
+  return done;
+}
+
+/* Name of the copy of a file in the content cache.  The size and the
+ * modification time are part of the name, so a changed file misses. */
+static gchar *
+content_cache_file (MTPObject * object)
+{
+  gchar *filename, *path;
+  filename = g_strdup_printf ("%s-%08x-%" G_GUINT64_FORMAT "-%ld",
+			      index_cache_prefix, object->id,
+			      (guint64) object->file->filesize,
+			      (long) object->file->modificationdate);
+  path = g_build_filename (content_cache_dir, filename, NULL);
+  g_free (filename);
+  return path;
+}
+
+/* Open the cached copy of a file, marking it as recently used.  Returns
+ * -1 if there is none. */
+static int
+open_cached (uint32_t item_id)
+{
+  MTPObject *object;
+  gchar *path;
+  int fd;
+  if (content_cache_dir == NULL)
+    return -1;
+  object = g_hash_table_lookup (object_index, GUINT_TO_POINTER (item_id));
+  if (object == NULL || object->file == NULL)
+    return -1;
+  path = content_cache_file (object);
+  fd = open (path, O_RDONLY);
+  if (fd != -1)
+    {
+      DBG ("reading %d from the content cache", item_id);
+      utime (path, NULL);
+    }
+  g_free (path);
+  return fd;
+}
+
+static gint
+compare_cache_use (gconstpointer a, gconstpointer b)
+{
+  const CacheEntry *ea = a, *eb = b;
+  return (ea->used > eb->used) - (ea->used < eb->used);
+}
+
+/* Delete the least recently used files until the content cache fits its
+ * budget again.  Files still being written are left alone, and files
+ * that are open stay readable until closed. */
+static void
+trim_content_cache ()
+{
+  GDir *dir;
+  GArray *entries;
+  const gchar *name;
+  guint64 total = 0;
+  int i;
+
+  dir = g_dir_open (content_cache_dir, 0, NULL);
+  if (dir == NULL)
+    return;
+  entries = g_array_new (FALSE, FALSE, sizeof (CacheEntry));
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      CacheEntry entry;
+      struct stat st;
+      if (g_str_has_suffix (name, ".part"))
+	continue;
+      entry.path = g_build_filename (content_cache_dir, name, NULL);
+      if (stat (entry.path, &st) != 0 || !S_ISREG (st.st_mode))
+	{
+	  g_free (entry.path);
+	  continue;
+	}
+      entry.size = st.st_size;
+      entry.used = st.st_mtime;
+      total += st.st_size;
+      g_array_append_val (entries, entry);
+    }
+  g_dir_close (dir);
+
+  g_array_sort (entries, compare_cache_use);
+  for (i = 0; i < entries->len; i++)
+    {
+      CacheEntry *entry = &g_array_index (entries, CacheEntry, i);
+      if (total > content_cache_size)
+	{
+	  DBG ("evicting %s", entry->path);
+	  unlink (entry->path);
+	  total -= entry->size;
+	}
+      g_free (entry->path);
+    }
+  g_array_free (entries, TRUE);
+}
+
+/* Make an unlinked file in the staging directory */
+static int
+stage_disk_fd ()
+{
+  gchar *name;
+  int fd;
+  name = g_build_filename (staging_dir, "mtpfs-XXXXXX", NULL);
+  fd = g_mkstemp (name);
+  if (fd != -1)
+    unlink (name);
+  g_free (name);
+  return fd;
+}
+
+/* Make a scratch file for a copy of about size bytes: in memory if it
+ * is small, else in the staging directory.  The size is charged against
+ * the staging budget without waiting, as callers hold the device. */
+static FILE *
+stage_open (uint64_t size)
+{
+  StagedFile *staged;
+  FILE *file;
+  int fd = -1;
+  gboolean memory = FALSE;
+
+#ifdef HAVE_MEMFD_CREATE
+  if (size <= staging_memory)
+    {
+      fd = memfd_create ("mtpfs", MFD_CLOEXEC);
+      memory = (fd != -1);
+    }
+#endif
+  if (fd == -1)
+    fd = stage_disk_fd ();
+  if (fd == -1)
+    return NULL;
+  file = fdopen (fd, "w+");
+  if (file == NULL)
+    {
+      close (fd);
+      return NULL;
+    }
+
+  staged = g_new0 (StagedFile, 1);
+  staged->size = size;
+  staged->memory = memory;
+  g_rw_lock_init (&staged->lock);
+  g_mutex_lock (&staging_lock);
+  if (staged_files == NULL)
+    staged_files = g_hash_table_new (g_direct_hash, g_direct_equal);
+  g_hash_table_insert (staged_files, GINT_TO_POINTER (fd), staged);
+  staged_bytes += size;
+  staged_peak = MAX (staged_peak, staged_bytes);
+  if (memory)
+    staged_memory_bytes += size;
+  DBG ("staging %" G_GUINT64_FORMAT " bytes, %" G_GUINT64_FORMAT
+       " in memory", staged_bytes, staged_memory_bytes);
+  g_mutex_unlock (&staging_lock);
+  return file;
+}
+
+/* Close a scratch file and give back its share of the budget.  Files
+ * that were not staged, such as content cache parts, are just closed. */
+static void
+stage_close (FILE * file)
+{
+  StagedFile *staged = NULL;
+  int fd = fileno (file);
+
+  g_mutex_lock (&staging_lock);
+  if (staged_files != NULL)
+    staged = g_hash_table_lookup (staged_files, GINT_TO_POINTER (fd));
+  if (staged != NULL)
+    {
+      g_hash_table_remove (staged_files, GINT_TO_POINTER (fd));
+      staged_bytes -= staged->size;
+      if (staged->memory)
+	staged_memory_bytes -= staged->size;
+      if (staged_bytes < staging_size)
+	staging_full = FALSE;
+      g_cond_broadcast (&staging_cond);
+      DBG ("staging %" G_GUINT64_FORMAT " bytes, %" G_GUINT64_FORMAT
+	   " in memory", staged_bytes, staged_memory_bytes);
+    }
+  // Closed under the lock so the descriptor is not reused meanwhile
+  fclose (file);
+  g_mutex_unlock (&staging_lock);
+  if (staged != NULL)
+    {
+      g_rw_lock_clear (&staged->lock);
+      g_free (staged);
+    }
+}
+
+/* Move a copy held in memory to the staging directory, keeping its
+ * descriptor.  Called with the file's lock held for writing. */
+static void
+stage_spill (int fd, StagedFile * staged)
+{
+  gchar buf[65536];
+  off_t offset = 0;
+  ssize_t n;
+  int disk = stage_disk_fd ();
+
+  if (disk == -1)
+    return;
+  while ((n = pread (fd, buf, sizeof (buf), offset)) > 0)
+    {
+      if (pwrite (disk, buf, n, offset) != n)
+	{
+	  close (disk);
+	  return;
+	}
+      offset += n;
+    }
+  if (n < 0 || dup2 (disk, fd) == -1)
+    {
+      close (disk);
+      return;
+    }
+  close (disk);
+  g_mutex_lock (&staging_lock);
+  staged->memory = FALSE;
+  staged_memory_bytes -= staged->size;
+  g_mutex_unlock (&staging_lock);
+  DBG ("spilled %d to disk at %" G_GUINT64_FORMAT " bytes", fd,
+       (uint64_t) offset);
+}
+
+/* Charge a staged file for a new size, or with grow_only for at least
+ * that size.  Growing waits, for a while,
+ * while other copies hold the whole budget, then fails with -ENOSPC.
+ * A file that outgrows memory is moved to the staging directory.
+ * Returns the file with its lock held for reading, or NULL if the
+ * descriptor is not staged. */
+static StagedFile *
+stage_resize (int fd, uint64_t size, gboolean grow_only, int *ret)
+{
+  StagedFile *staged = NULL;
+  gboolean spill = FALSE;
+  gint64 deadline;
+
+  *ret = 0;
+  g_mutex_lock (&staging_lock);
+  if (staged_files != NULL)
+    staged = g_hash_table_lookup (staged_files, GINT_TO_POINTER (fd));
+  if (staged == NULL)
+    {
+      g_mutex_unlock (&staging_lock);
+      return NULL;
+    }
+  if (grow_only)
+    size = MAX (size, staged->size);
+  if (size > staged->size && staging_size > 0)
+    {
+      deadline = g_get_monotonic_time () +
+	STAGING_WAIT_TIMEOUT * G_TIME_SPAN_SECOND;
+      // A file alone in the budget never waits on itself
+      while (staged_bytes + (size - staged->size) > staging_size
+	     && staged_bytes > staged->size)
+	{
+	  if (!staging_full)
+	    {
+	      g_message ("staging full, %" G_GUINT64_FORMAT " of %"
+			 G_GUINT64_FORMAT " MB in use: waiting for files "
+			 "to be sent", staged_bytes >> 20, staging_size >> 20);
+	      staging_full = TRUE;
+	    }
+	  if (!g_cond_wait_until (&staging_cond, &staging_lock, deadline))
+	    {
+	      g_mutex_unlock (&staging_lock);
+	      g_warning ("no staging space for %" G_GUINT64_FORMAT
+			 " MB more after %d seconds",
+			 (size - staged->size) >> 20, STAGING_WAIT_TIMEOUT);
+	      *ret = -ENOSPC;
+	      return NULL;
+	    }
+	}
+    }
+  staged_bytes = staged_bytes - staged->size + size;
+  staged_peak = MAX (staged_peak, staged_bytes);
+  if (staged->memory)
+    staged_memory_bytes = staged_memory_bytes - staged->size + size;
+  if (size < staged->size)
+    g_cond_broadcast (&staging_cond);
+  staged->size = size;
+  spill = staged->memory && size > staging_memory;
+  g_mutex_unlock (&staging_lock);
+
+  if (spill)
+    {
+      g_rw_lock_writer_lock (&staged->lock);
+      if (staged->memory)
+	stage_spill (fd, staged);
+      g_rw_lock_writer_unlock (&staged->lock);
+    }
+  g_rw_lock_reader_lock (&staged->lock);
+  return staged;
+}
+
+/* Write to a staged copy, charging it for any growth */
+static int
+stage_write (int fd, const gchar * buf, size_t size, off_t offset)
+{
+  StagedFile *staged;
+  int ret;
+
+  staged = stage_resize (fd, offset + size, TRUE, &ret);
+  if (ret < 0)
+    return ret;
+  ret = pwrite (fd, buf, size, offset);
+  if (ret == -1)
+    ret = -errno;
+  if (staged != NULL)
+    g_rw_lock_reader_unlock (&staged->lock);
+  return ret;
+}
+
+/* Drop a reference to a copy, deleting it with the last one.  Called
+ * with download_lock held. */
+static void
+unref_download (Download * download)
+{
+  if (--download->refs > 0)
+    return;
+  if (g_hash_table_lookup (downloads, GUINT_TO_POINTER (download->id)) ==
+      download)
+    g_hash_table_remove (downloads, GUINT_TO_POINTER (download->id));
+  stage_close (download->file);
+  g_free (download);
+}
+
+static uint16_t
+download_put (void *params, void *priv, uint32_t sendlen,
+	      unsigned char *data, uint32_t * putlen)
+{
+  Download *download = priv;
+  uint16_t ret = LIBMTP_HANDLER_RETURN_OK;
+  uint32_t written = 0;
+
+  while (written < sendlen)
+    {
+      ssize_t n = pwrite (fileno (download->file), data + written,
+			  sendlen - written, download->received + written);
+      if (n <= 0)
+	return LIBMTP_HANDLER_RETURN_ERROR;
+      written += n;
+    }
+  *putlen = written;
+  g_mutex_lock (&download_lock);
+  download->received += written;
+  g_cond_broadcast (&download_cond);
+  // Nobody is left to read the rest
+  if (download->refs == 1 || downloads_stop)
+    ret = LIBMTP_HANDLER_RETURN_CANCEL;
+  g_mutex_unlock (&download_lock);
+  return ret;
+}
+
+static gpointer
+run_download (gpointer data)
+{
+  Download *download = data;
+  int ret;
+
+  enter_lock ("download %d", download->id);
+  ret = LIBMTP_Get_File_To_Handler (device, download->id, download_put,
+				    download, NULL, NULL);
+  if (ret != 0)
+    {
+      DBG ("download of %d stopped", download->id);
+      LIBMTP_Dump_Errorstack (device);
+      LIBMTP_Clear_Errorstack (device);
+    }
+  g_mutex_unlock (&device_lock);
+
+  g_mutex_lock (&download_lock);
+  gchar *part = download->part;
+  download->part = NULL;
+  download->done = TRUE;
+  download->failed = (ret != 0);
+  if (download->failed
+      && g_hash_table_lookup (downloads,
+			      GUINT_TO_POINTER (download->id)) == download)
+    g_hash_table_remove (downloads, GUINT_TO_POINTER (download->id));
+  unref_download (download);
+  downloads_running--;
+  g_cond_broadcast (&download_cond);
+  g_mutex_unlock (&download_lock);
+
+  if (part != NULL)
+    {
+      if (ret == 0)
+	{
+	  // Complete: make it visible to the next open
+	  gchar *path = g_strndup (part, strlen (part) - strlen (".part"));
+	  rename (part, path);
+	  g_free (path);
+	  trim_content_cache ();
+	}
+      else
+	{
+	  unlink (part);
+	}
+      g_free (part);
+    }
+  return NULL;
+}
+
+/* Start copying a file from the device for a read-only handle, or share
+ * the copy already made or under way for another handle that is still
+ * open.  Returns NULL if there is nowhere to put the copy. */
+static Download *
+open_download (uint32_t item_id)
+{
+  Download *download;
+  MTPObject *object;
+  FILE *filetmp = NULL;
+
+  g_mutex_lock (&download_lock);
+  if (downloads == NULL)
+    downloads = g_hash_table_new (g_direct_hash, g_direct_equal);
+  object = g_hash_table_lookup (object_index, GUINT_TO_POINTER (item_id));
+  download = g_hash_table_lookup (downloads, GUINT_TO_POINTER (item_id));
+  if (download != NULL && object != NULL && object->file != NULL
+      && (download->size != object->file->filesize
+	  || download->modified != object->file->modificationdate))
+    {
+      // Changed on the device; the open handles keep the old copy
+      g_hash_table_remove (downloads, GUINT_TO_POINTER (item_id));
+      download = NULL;
+    }
+  if (download != NULL)
+    {
+      DBG ("sharing the copy of %d", item_id);
+      download->refs++;
+      g_mutex_unlock (&download_lock);
+      return download;
+    }
+
+  download = g_new0 (Download, 1);
+  download->id = item_id;
+  // Files that fit are copied straight into the content cache; larger
+  // ones would only push everything else out, so they stay staged
+  if (content_cache_dir != NULL && object != NULL && object->file != NULL
+      && object->file->filesize <= content_cache_size / 4)
+    {
+      gchar *path = content_cache_file (object);
+      gchar *part = g_strconcat (path, ".part", NULL);
+      filetmp = fopen (part, "w+");
+      g_free (path);
+      if (filetmp != NULL)
+	download->part = part;
+      else
+	g_free (part);
+    }
+  if (filetmp == NULL)
+    filetmp = stage_open (object != NULL && object->file != NULL
+			  ? object->file->filesize : 0);
+  if (filetmp == NULL)
+    {
+      g_free (download);
+      g_mutex_unlock (&download_lock);
+      return NULL;
+    }
+  download->file = filetmp;
+  download->refs = 2;
+  if (object != NULL && object->file != NULL)
+    {
+      download->size = object->file->filesize;
+      download->modified = object->file->modificationdate;
+    }
+  g_hash_table_insert (downloads, GUINT_TO_POINTER (item_id), download);
+  downloads_running++;
+  g_mutex_unlock (&download_lock);
+  // Runs once the caller lets go of the device
+  g_thread_unref (g_thread_new ("download", run_download, download));
+  return download;
+}
+
+/* Wait, without taking the device lock that the copy in progress holds,
+ * until a shared copy holds a range.  Returns -EIO if the copy failed
+ * short of the range. */
+static int
+wait_download (Download * download, size_t size, off_t offset)
+{
+  int ret = 0;
+  g_mutex_lock (&download_lock);
+  while (!download->done && download->received < offset + size)
+    g_cond_wait (&download_cond, &download_lock);
+  if (download->failed && download->received < offset + size)
+    ret = -EIO;
+  g_mutex_unlock (&download_lock);
+  return ret;
+}
+
+static void
+close_handle (MTPHandle * handle)
+{
+  if (handle->download != NULL)
+    {
+      g_mutex_lock (&download_lock);
+      unref_download (handle->download);
+      g_mutex_unlock (&download_lock);
+    }
+  else if (handle->file != NULL)
+    {
+      stage_close (handle->file);
+    }
+  else if (handle->fd != -1)
+    {
+      close (handle->fd);
+    }
+  if (handle->upload != NULL)
+    {
+      Upload *upload = handle->upload;
+      if (upload->file != NULL)
+	LIBMTP_destroy_file_t (upload->file);
+      g_mutex_clear (&upload->lock);
+      g_cond_clear (&upload->cond);
+      g_free (upload->ring);
+      g_free (upload);
+    }
+  if (handle->path != NULL)
+    {
+      if (g_hash_table_lookup (replacing, handle->path) == handle)
+	g_hash_table_remove (replacing, handle->path);
+      g_free (handle->path);
+      myfiles_version++;
+    }
+  g_free (handle->remote);
+  if (handle->edit_buffer != NULL)
+    g_byte_array_free (handle->edit_buffer, TRUE);
+  g_mutex_clear (&handle->lock);
+  g_free (handle);
+}
+
+static uint16_t
+upload_get (void *params, void *priv, uint32_t wantlen,
+	    unsigned char *data, uint32_t * gotlen)
+{
+  Upload *upload = priv;
+  uint32_t done = 0;
+
+  g_mutex_lock (&upload->lock);
+  while (done < wantlen)
+    {
+      gsize position, count;
+      // The device stays locked meanwhile, so do not wait for ever on a
+      // writer that is itself stuck behind the lock
+      gint64 deadline = g_get_monotonic_time () +
+	UPLOAD_STALL_TIMEOUT * G_USEC_PER_SEC;
+      while (upload->written == upload->sent && !upload->closed
+	     && !upload->failed)
+	{
+	  if (!g_cond_wait_until (&upload->cond, &upload->lock, deadline))
+	    break;
+	}
+      if (upload->failed || upload->written == upload->sent)
+	break;
+      position = upload->sent % UPLOAD_RING_SIZE;
+      count = MIN (wantlen - done, upload->written - upload->sent);
+      count = MIN (count, UPLOAD_RING_SIZE - position);
+      memcpy (data + done, upload->ring + position, count);
+      upload->sent += count;
+      done += count;
+      g_cond_broadcast (&upload->cond);
+    }
+  *gotlen = done;
+  if (done < wantlen)
+    {
+      // Released before the announced size was written
+      upload->failed = TRUE;
+      g_mutex_unlock (&upload->lock);
+      return LIBMTP_HANDLER_RETURN_ERROR;
+    }
+  g_mutex_unlock (&upload->lock);
+  return LIBMTP_HANDLER_RETURN_OK;
+}
+
+static gpointer
+run_upload (gpointer data)
+{
+  Upload *upload = data;
+  int ret;
+
+  enter_lock ("upload %s", upload->file->filename);
+  ret = LIBMTP_Send_File_From_Handler (device, upload_get, upload,
+				       upload->file, NULL, NULL);
+  if (ret == 0)
+    {
+      upload->file->modificationdate = time (NULL);
+      add_file (upload->file);
+      upload->file = NULL;
+    }
+  else
+    {
+      DBG ("Problem sending %s - %d", upload->file->filename, ret);
+      LIBMTP_Dump_Errorstack (device);
+      LIBMTP_Clear_Errorstack (device);
+      // The object may or may not exist after a failed send, so refresh
+      files_changed = TRUE;
+    }
+  g_mutex_lock (&upload->lock);
+  upload->result = ret;
+  upload->finished = TRUE;
+  if (ret != 0)
+    upload->failed = TRUE;
+  g_cond_broadcast (&upload->cond);
+  g_mutex_unlock (&upload->lock);
+  return_unlock (NULL);
+}
+
+/* Send a new file while it is written, now that its size is known.  Only
+ * an empty file can start, since the device gets the data in order. */
+static gboolean
+start_upload (const char *path, MTPHandle * handle, uint64_t size)
+{
+  MTPPath mp;
+  LIBMTP_filetype_t filetype;
+  LIBMTP_file_t *genfile;
+  Upload *upload;
+  struct stat st;
+  int parent_id;
+
+  if (fstat (handle->fd, &st) != 0 || st.st_size != 0)
+    return FALSE;
+  enter_lock ("stream %s", path);
+  if (strncmp ("/Playlists/", path, 11) == 0 || !split_path (&mp, path))
+    return_unlock (FALSE);
+  filetype = find_filetype (mp.name);
+#ifdef USEMAD
+  // Track tags are read from the whole file at release
+  if (filetype == LIBMTP_FILETYPE_MP3)
+    return_unlock (FALSE);
+#endif
+  parent_id = resolve_parent (&mp);
+  if (parent_id < 0)
+    parent_id = 0;
+
+  genfile = LIBMTP_new_file_t ();
+  genfile->filesize = size;
+  genfile->filetype = filetype;
+  genfile->filename = g_strdup (mp.name);
+  genfile->parent_id = (uint32_t) parent_id;
+  genfile->storage_id = storageArea[mp.storageid].storage->id;
+
+  upload = g_new0 (Upload, 1);
+  g_mutex_init (&upload->lock);
+  g_cond_init (&upload->cond);
+  upload->ring = g_malloc (UPLOAD_RING_SIZE);
+  upload->size = size;
+  upload->file = genfile;
+  handle->upload = upload;
+  DBG ("streaming %s, %" G_GUINT64_FORMAT " bytes", path, (guint64) size);
+  // Starts sending once the caller lets go of the device
+  upload->thread = g_thread_new ("upload", run_upload, upload);
+  return_unlock (TRUE);
+}
+
+static int
+write_upload (Upload * upload, const gchar * buf, size_t size, off_t offset)
+{
+  int done = 0;
+  g_mutex_lock (&upload->lock);
+  if (offset != upload->written || upload->written + size > upload->size)
+    {
+      DBG ("write at %ld does not follow on, giving up", (long) offset);
+      upload->failed = TRUE;
+      g_cond_broadcast (&upload->cond);
+    }
+  while (done < size && !upload->failed)
+    {
+      gsize position, count;
+      while (upload->written - upload->sent == UPLOAD_RING_SIZE
+	     && !upload->failed)
+	g_cond_wait (&upload->cond, &upload->lock);
+      if (upload->failed)
+	break;
+      position = upload->written % UPLOAD_RING_SIZE;
+      count = MIN (size - done,
+		   UPLOAD_RING_SIZE - (upload->written - upload->sent));
+      count = MIN (count, UPLOAD_RING_SIZE - position);
+      memcpy (upload->ring + position, buf + done, count);
+      upload->written += count;
+      done += count;
+      g_cond_broadcast (&upload->cond);
+    }
+  if (upload->failed)
+    done = -EIO;
+  g_mutex_unlock (&upload->lock);
+  return done;
+}
+
+/* Wait for the send of a released file to end */
+static int
+finish_upload (Upload * upload)
+{
+  g_mutex_lock (&upload->lock);
+  upload->closed = TRUE;
+  g_cond_broadcast (&upload->cond);
+  g_mutex_unlock (&upload->lock);
+  g_thread_join (upload->thread);
+  return upload->result == 0 ? 0 : -EIO;
+}
+
+/* Edit an existing file in place, on devices with the Android edit
+ * extensions, so only the bytes written are sent.  Reads go through the
+ * partial read path, so read-write opens need it.  Whole rewrites are
+ * sent as a replacement instead, in one transfer.  Called with the
+ * device lock held. */
+static gboolean
+begin_edit (MTPHandle * handle, uint32_t item_id, int flags)
+{
+#ifdef HAVE_LIBMTP_BEGINEDITOBJECT
+  MTPObject *object;
+  if ((flags & O_TRUNC)
+      || ((flags & O_ACCMODE) == O_RDWR && !partial_reads))
+    return FALSE;
+  object = g_hash_table_lookup (object_index, GUINT_TO_POINTER (item_id));
+  if (object == NULL || object->file == NULL)
+    return FALSE;
+  if (LIBMTP_BeginEditObject (device, item_id) != 0)
+    {
+      LIBMTP_Dump_Errorstack (device);
+      LIBMTP_Clear_Errorstack (device);
+      return FALSE;
+    }
+  handle->remote = g_new0 (RemoteFile, 1);
+  handle->remote->id = item_id;
+  handle->remote->size = object->file->filesize;
+  handle->editing = TRUE;
+  handle->edit_buffer = g_byte_array_sized_new (EDIT_BUFFER_SIZE);
+  DBG ("editing %d in place", item_id);
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+/* Send the writes gathered on an editing handle.  Called with the
+ * handle's lock held. */
+static int
+send_edit (MTPHandle * handle)
+{
+#ifdef HAVE_LIBMTP_BEGINEDITOBJECT
+  RemoteFile *remote = handle->remote;
+  GByteArray *buffer = handle->edit_buffer;
+  int ret = 0;
+  if (buffer->len == 0)
+    return 0;
+  enter_lock ("edit %d", remote->id);
+  if (LIBMTP_SendPartialObject (device, remote->id, handle->edit_offset,
+				buffer->data, buffer->len) != 0)
+    {
+      LIBMTP_Dump_Errorstack (device);
+      LIBMTP_Clear_Errorstack (device);
+      ret = -EIO;
+    }
+  else
+    {
+      remote->size = MAX (remote->size, handle->edit_offset + buffer->len);
+    }
+  drop_chunks (remote->id);
+  handle->dirty = TRUE;
+  g_byte_array_set_size (buffer, 0);
+  return_unlock (ret);
+#else
+  return -EBADF;
+#endif
+}
+
+/* Send what an editing handle has gathered, before it is read or changed
+ * some other way */
+static int
+flush_edit (MTPHandle * handle)
+{
+  int ret;
+  if (!handle->editing)
+    return 0;
+  g_mutex_lock (&handle->lock);
+  ret = send_edit (handle);
+  g_mutex_unlock (&handle->lock);
+  return ret;
+}
+
+/* Gather contiguous writes, so the device sees one edit per megabyte
+ * rather than one per write */
+static int
+edit_write (MTPHandle * handle, const gchar * buf, size_t size,
+	    off_t offset)
+{
+  GByteArray *buffer = handle->edit_buffer;
+  int ret = 0;
+  g_mutex_lock (&handle->lock);
+  if (buffer->len > 0
+      && ((uint64_t) offset != handle->edit_offset + buffer->len
+	  || buffer->len + size > EDIT_BUFFER_SIZE))
+    ret = send_edit (handle);
+  if (ret == 0)
+    {
+      if (buffer->len == 0)
+	handle->edit_offset = offset;
+      g_byte_array_append (buffer, (const guint8 *) buf, size);
+      if (buffer->len >= EDIT_BUFFER_SIZE)
+	ret = send_edit (handle);
+    }
+  g_mutex_unlock (&handle->lock);
+  return (ret < 0) ? ret : size;
+}
+
+static int
+edit_truncate (MTPHandle * handle, off_t size)
+{
+#ifdef HAVE_LIBMTP_BEGINEDITOBJECT
+  RemoteFile *remote = handle->remote;
+  int ret = flush_edit (handle);
+  if (ret < 0)
+    return ret;
+  enter_lock ("edit truncate %d", remote->id);
+  if (LIBMTP_TruncateObject (device, remote->id, size) != 0)
+    {
+      LIBMTP_Dump_Errorstack (device);
+      LIBMTP_Clear_Errorstack (device);
+      return_unlock (-EIO);
+    }
+  drop_chunks (remote->id);
+  remote->size = size;
+  handle->dirty = TRUE;
+  return_unlock (0);
+#else
+  return -EBADF;
+#endif
+}
+
+/* Finish an edit and bring the index in line with it.  Called with the
+ * device lock held. */
+static int
+end_edit (MTPHandle * handle)
+{
+  int ret = 0;
+#ifdef HAVE_LIBMTP_BEGINEDITOBJECT
+  RemoteFile *remote = handle->remote;
+  MTPObject *object;
+  if (LIBMTP_EndEditObject (device, remote->id) != 0)
+    {
+      LIBMTP_Dump_Errorstack (device);
+      LIBMTP_Clear_Errorstack (device);
+      ret = -EIO;
+    }
+  object = g_hash_table_lookup (object_index, GUINT_TO_POINTER (remote->id));
+  if (handle->dirty && object != NULL && object->file != NULL)
+    {
+      object->file->filesize = remote->size;
+      object->file->modificationdate = time (NULL);
+      index_version++;
+    }
+#endif
+  return ret;
+}
+
+static int
+mtpfs_open (const gchar * path, struct fuse_file_info *fi)
+{
+  // A file still queued is opened once it is on the device
+  wait_queued_upload (path);
+  enter_lock ("open");
+  int item_id = -1;
+  item_id = parse_path (path);
+  if (item_id < 0)
+    return_unlock (-ENOENT);
+
+  switch (fi->flags & O_ACCMODE)
+    {
+    case O_RDONLY:
+      DBG ("read");
+      break;
+    case O_WRONLY:
+      DBG ("write");
+      break;
+    case O_RDWR:
+      DBG ("rdwrite");
+      break;
+    default:
+      DBG ("unexpected access mode: %d", fi->flags & O_ACCMODE);
+    }
 
-  // If in root directory
-  if (strcmp (path, "/") == 0)
+  int storageid;
+  storageid = find_storage (path);
+  if (storageid < 0)
     {
-      filler (buf, "Playlists", NULL, 0);
-      if (lostfiles != NULL)
-	{
-	  filler (buf, "lost+found", NULL, 0);
-	}
-      LIBMTP_devicestorage_t *storage;
-      for (storage = device->storage; storage != 0; storage = storage->next)
+      return_unlock (-ENOENT);
+    }
+  MTPObject *object;
+  uint64_t filesize = 0;
+  object = g_hash_table_lookup (object_index, GUINT_TO_POINTER (item_id));
+  if (object != NULL && object->file != NULL && !(fi->flags & O_TRUNC))
+    filesize = object->file->filesize;
+  // Staged in memory or on disk depending on how much is coming, and
+  // only by the branches that keep the staged file
+  FILE *filetmp = NULL;
+  int cached;
+  MTPHandle *handle = g_new0 (MTPHandle, 1);
+  handle->fd = -1;
+  if (item_id == 0 || strncmp ("/Playlists/", path, 11) == 0)
+    {
+      filetmp = stage_open (0);
+      if (filetmp == NULL)
 	{
-	  struct stat st;
-	  memset (&st, 0, sizeof (st));
-	  st.st_nlink = 2;
-	  st.st_ino = storage->id;
-	  st.st_mode = S_IFREG | 0555;
-	  gchar *name;
-	  filler (buf, storage->StorageDescription, &st, 0);
+	  g_free (handle);
+	  return_unlock (-ENOENT);
 	}
-      return_unlock (0);
+      handle->fd = fileno (filetmp);
+      handle->file = filetmp;
     }
-  // Are we looking at the playlists?
-  if (strncmp (path, "/Playlists", 10) == 0)
+  if (item_id == 0)
     {
-      DBG ("Checking Playlists");
+      handle->created = TRUE;
+    }
+  else if (strncmp ("/Playlists/", path, 11) == 0)
+    {
+      // Is a playlist
       LIBMTP_playlist_t *playlist;
       check_playlists ();
       playlist = playlists;
       while (playlist != NULL)
 	{
-	  struct stat st;
-	  memset (&st, 0, sizeof (st));
-	  st.st_ino = playlist->playlist_id;
-	  st.st_mode = S_IFREG | 0666;
-	  gchar *name;
-	  name = g_strconcat (playlist->name, ".m3u", NULL);
-	  DBG ("Playlist:%s", name);
-	  if (filler (buf, name, &st, 0))
+	  if (is_playlist_path (path, playlist))
 	    {
-	      g_free (name);
+	      PlaylistRender *render = render_playlist (playlist);
+	      fwrite (render->body, 1, render->length, filetmp);
+	      fflush (filetmp);
 	      break;
 	    }
-	  g_free (name);
 	  playlist = playlist->next;
 	}
-      return_unlock (0);
     }
-  // Are we looking at lost+found dir?
-  if (strncmp (path, "/lost+found", 11) == 0)
+  else if ((fi->flags & O_ACCMODE) == O_RDONLY
+	   && (cached = open_cached (item_id)) != -1)
     {
-      check_files ();
-      GSList *item;
-
-      for (item = lostfiles; item != NULL; item = g_slist_next (item))
+      handle->fd = cached;
+    }
+  else if ((fi->flags & O_ACCMODE) == O_RDONLY
+	   && (handle->remote = open_remote (item_id)) != NULL)
+    {
+      // Read from the device in chunks, nothing is staged
+    }
+  else if ((fi->flags & O_ACCMODE) == O_RDONLY)
+    {
+      handle->download = open_download (item_id);
+      if (handle->download == NULL)
 	{
-	  LIBMTP_file_t *file = (LIBMTP_file_t *) item->data;
-
-	  struct stat st;
-	  memset (&st, 0, sizeof (st));
-	  st.st_ino = file->item_id;
-	  st.st_mode = S_IFREG | 0444;
-	  if (filler
-	      (buf,
-	       (file->filename ==
-		NULL ? "<mtpfs null>" : file->filename), &st, 0))
-	    break;
+	  g_free (handle);
+	  return_unlock (-ENOENT);
 	}
-      return_unlock (0);
+      handle->fd = fileno (handle->download->file);
     }
-  // Get storage area
-  int i;
-  int storageid = -1;
-  storageid = find_storage (path);
-  if (storageid < 0)
+  else if (edit_objects && begin_edit (handle, item_id, fi->flags))
     {
-      return_unlock (-ENOENT);
+      // Written to the device as it goes, nothing is staged
     }
-  // Get folder listing.
-  int folder_id = 0;
-  if (strcmp (path, "/") != 0)
+  else
     {
-      check_folders ();
-      folder_id =
-	lookup_folder_id (storageArea[storageid].folders,
-			  (gchar *) path, NULL);
+      // The new contents replace the object when it is closed
+      filetmp = stage_open (filesize);
+      if (filetmp == NULL)
+	{
+	  g_free (handle);
+	  return_unlock (-ENOENT);
+	}
+      int tmpfile = fileno (filetmp);
+      handle->fd = tmpfile;
+      handle->file = filetmp;
+      handle->replace_id = item_id;
+      handle->old_size = filesize;
+      if (fi->flags & O_TRUNC)
+	{
+	  handle->complete = TRUE;
+	  handle->dirty = TRUE;
+	}
+      else if ((fi->flags & O_ACCMODE) == O_RDWR)
+	{
+	  int ret = LIBMTP_Get_File_To_File_Descriptor (device, item_id,
+							tmpfile,
+							NULL, NULL);
+	  if (ret != 0)
+	    {
+	      stage_close (filetmp);
+	      g_free (handle);
+	      return_unlock (-ENOENT);
+	    }
+	  handle->complete = TRUE;
+	}
+      // Write-only opens fetch the old contents only if writes leave gaps
+      if (replacing == NULL)
+	replacing = g_hash_table_new (g_str_hash, g_str_equal);
+      handle->path = g_strdup (path);
+      g_hash_table_replace (replacing, handle->path, handle);
+      myfiles_version++;
     }
+  g_mutex_init (&handle->lock);
+  fi->fh = (uintptr_t) handle;
 
-  DBG ("Checking folders for %d", storageid);
-  check_folders ();
-  if (folder_id == -2)
+  return_unlock (0);
+}
+
+static int
+mtpfs_read (const gchar * path, gchar * buf, size_t size, off_t offset,
+	    struct fuse_file_info *fi)
+{
+  MTPHandle *handle = HANDLE (fi);
+  int ret;
+
+  if (handle->remote != NULL)
     {
-      DBG ("Root of storage area");
-      folder = storageArea[storageid].folders;
+      ret = flush_edit (handle);
+      if (ret < 0)
+	return ret;
+      enter_lock ("read");
+      ret = read_remote (handle->remote, buf, size, offset);
+      return_unlock (ret);
     }
-  else
+  if (handle->download != NULL)
     {
-      folder = LIBMTP_Find_Folder (storageArea[storageid].folders, folder_id);
-      if (folder == NULL)
-	return_unlock (0);
-      folder = folder->child;
+      ret = wait_download (handle->download, size, offset);
+      if (ret < 0)
+	return ret;
     }
+  ret = pread (handle->fd, buf, size, offset);
+  if (ret == -1)
+    ret = -errno;
+  return ret;
+}
+
+/* Hand the kernel the backing file itself, so the data can be spliced
+ * from the page cache without passing through our buffers.  Only files
+ * read from the device in chunks are copied out of memory. */
+static int
+mtpfs_read_buf (const gchar * path, struct fuse_bufvec **bufp, size_t size,
+		off_t offset, struct fuse_file_info *fi)
+{
+  MTPHandle *handle = HANDLE (fi);
+  struct fuse_bufvec *src;
+  int ret;
 
-  while (folder != NULL)
+  src = malloc (sizeof (struct fuse_bufvec));
+  if (src == NULL)
+    return -ENOMEM;
+  *src = FUSE_BUFVEC_INIT (size);
+  if (handle->remote != NULL)
     {
-      if ((folder->parent_id == folder_id) ||
-	  (folder_id == -2
-	   && (folder->storage_id == storageArea[storageid].storage->id)))
+      src->buf[0].mem = malloc (size);
+      if (src->buf[0].mem == NULL)
 	{
-	  DBG ("found folder: %s, id %d", folder->name, folder->folder_id);
-	  struct stat st;
-	  memset (&st, 0, sizeof (st));
-	  st.st_ino = folder->folder_id;
-	  st.st_mode = S_IFDIR | 0777;
-	  if (filler (buf, folder->name, &st, 0))
-	    break;
+	  free (src);
+	  return -ENOMEM;
+	}
+      ret = mtpfs_read (path, src->buf[0].mem, size, offset, fi);
+      if (ret < 0)
+	{
+	  free (src->buf[0].mem);
+	  free (src);
+	  return ret;
 	}
-      folder = folder->sibling;
+      src->buf[0].size = ret;
+      *bufp = src;
+      return 0;
     }
-  DBG ("Checking folders end");
-  LIBMTP_destroy_folder_t (folder);
-  DBG ("Checking files");
-  // Find files
-  LIBMTP_file_t *file, *tmp;
-  check_files ();
-  file = files;
-  while (file != NULL)
+  if (handle->download != NULL)
     {
-      if ((file->parent_id == folder_id) ||
-	  (folder_id == -2 && (file->parent_id == 0)
-	   && (file->storage_id == storageArea[storageid].storage->id)))
+      ret = wait_download (handle->download, size, offset);
+      if (ret < 0)
 	{
-	  struct stat st;
-	  memset (&st, 0, sizeof (st));
-	  st.st_ino = file->item_id;
-	  st.st_mode = S_IFREG | 0444;
-	  if (filler
-	      (buf,
-	       (file->filename ==
-		NULL ? "<mtpfs null>" : file->filename), &st, 0))
-	    break;
+	  free (src);
+	  return ret;
 	}
-      tmp = file;
-      file = file->next;
     }
-  DBG ("readdir exit");
-  return_unlock (0);
+  src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+  src->buf[0].fd = handle->fd;
+  src->buf[0].pos = offset;
+  *bufp = src;
+  return 0;
+}
+
+typedef struct
+{
+  MTPHandle *handle;
+  uint64_t received;
+} OldContents;
+
+static uint16_t
+old_contents_put (void *params, void *priv, uint32_t sendlen,
+		  unsigned char *data, uint32_t * putlen)
+{
+  OldContents *old = priv;
+  MTPHandle *handle = old->handle;
+  uint64_t start = old->received;
+
+  old->received += sendlen;
+  *putlen = sendlen;
+  // What has been written since the open wins over the old contents
+  if (old->received <= handle->filled)
+    return LIBMTP_HANDLER_RETURN_OK;
+  if (start < handle->filled)
+    {
+      data += handle->filled - start;
+      sendlen -= handle->filled - start;
+      start = handle->filled;
+    }
+  if (pwrite (handle->fd, data, sendlen, start) != (ssize_t) sendlen)
+    return LIBMTP_HANDLER_RETURN_ERROR;
+  return LIBMTP_HANDLER_RETURN_OK;
 }
 
+/* Fill in the part of a replacement that has not been written from the
+ * old object.  Called with the handle's lock held. */
 static int
-mtpfs_getattr_real (const gchar * path, struct stat *stbuf)
+fetch_old_contents (MTPHandle * handle)
 {
-  int ret = 0;
-  if (path == NULL)
-    return -ENOENT;
-  memset (stbuf, 0, sizeof (struct stat));
+  OldContents old = { handle, 0 };
+  StagedFile *staged;
+  int ret;
 
-  // Set uid/gid of file
-  struct fuse_context *fc;
-  fc = fuse_get_context ();
-  stbuf->st_uid = fc->uid;
-  stbuf->st_gid = fc->gid;
-  if (strcmp (path, "/") == 0)
+  if (handle->filled >= handle->old_size)
     {
-      stbuf->st_mode = S_IFDIR | 0777;
-      stbuf->st_nlink = 2;
+      handle->complete = TRUE;
       return 0;
     }
-  // Check cached files first (stuff that hasn't been written to dev yet)
-  GSList *item;
-  if (myfiles != NULL)
+  staged = stage_resize (handle->fd, handle->old_size, TRUE, &ret);
+  if (ret < 0)
+    return ret;
+  enter_lock ("fetch old contents of %d", handle->replace_id);
+  ret = LIBMTP_Get_File_To_Handler (device, handle->replace_id,
+				    old_contents_put, &old, NULL, NULL);
+  if (ret != 0)
     {
-      item = g_slist_find_custom (myfiles, path, (GCompareFunc) strcmp);
-      if (item != NULL)
-	{
-	  stbuf->st_mode = S_IFREG | 0777;
-	  stbuf->st_size = 0;
-	  stbuf->st_blocks = 2;
-	  stbuf->st_mtime = time (NULL);
-	  return 0;
-	}
+      LIBMTP_Dump_Errorstack (device);
+      LIBMTP_Clear_Errorstack (device);
     }
-  // Special case directory 'Playlists', 'lost+found'
-  // Special case root directory items
-  if (g_strrstr (path + 1, "/") == NULL)
+  g_mutex_unlock (&device_lock);
+  if (staged != NULL)
+    g_rw_lock_reader_unlock (&staged->lock);
+  if (ret != 0)
+    return -EIO;
+  handle->complete = TRUE;
+  return 0;
+}
+
+/* Note a write to a replacement.  Writes that follow on from the start
+ * need nothing from the old object; the first one that leaves a gap
+ * fetches it. */
+static int
+fill_replacement (MTPHandle * handle, off_t offset, size_t size)
+{
+  int ret = 0;
+  g_mutex_lock (&handle->lock);
+  handle->dirty = TRUE;
+  if (!handle->complete)
     {
-      stbuf->st_mode = S_IFDIR | 0777;
-      stbuf->st_nlink = 2;
-      return 0;
+      if ((uint64_t) offset <= handle->filled)
+	handle->filled = MAX (handle->filled, offset + size);
+      else
+	ret = fetch_old_contents (handle);
     }
+  g_mutex_unlock (&handle->lock);
+  return ret;
+}
 
-  int storageid;
-  storageid = find_storage (path);
-  if (storageid < 0)
+static int
+mtpfs_write (const gchar * path, const gchar * buf, size_t size, off_t offset,
+	     struct fuse_file_info *fi)
+{
+  MTPHandle *handle = HANDLE (fi);
+  if (handle->upload != NULL)
+    return write_upload (handle->upload, buf, size, offset);
+  if (handle->editing)
+    return edit_write (handle, buf, size, offset);
+  if (handle->fd == -1 || handle->download != NULL)
+    return -EBADF;
+  handle->saved = FALSE;
+  if (handle->replace_id != 0)
     {
-      return -ENOENT;
+      int ret = fill_replacement (handle, offset, size);
+      if (ret < 0)
+	return ret;
     }
+  return stage_write (handle->fd, buf, size, offset);
+}
 
-  if (g_ascii_strncasecmp (path, "/Playlists", 10) == 0)
+static void
+unref_queued (QueuedUpload * job)
+{
+  if (--job->refs > 0)
+    return;
+  stage_close (job->file);
+#ifdef USEMAD
+  if (job->track != NULL)
+    LIBMTP_destroy_track_t (job->track);
+#endif
+  g_free (job->path);
+  g_free (job);
+}
+
+#ifdef USEMAD
+/* Read the tags of an MP3 file into a new track */
+static LIBMTP_track_t *
+read_track (QueuedUpload * job, const gchar * filename)
+{
+  LIBMTP_track_t *genfile;
+  gint songlen;
+  struct id3_file *id3_fh;
+  struct id3_tag *tag;
+  gchar *tracknum;
+  int fd = fileno (job->file);
+
+  genfile = LIBMTP_new_track_t ();
+  // id3_file_close closes the descriptor it is given
+  id3_fh = id3_file_fdopen (dup (fd), ID3_FILE_MODE_READONLY);
+  tag = id3_file_tag (id3_fh);
+
+  genfile->artist = getArtist (tag);
+  genfile->title = getTitle (tag);
+  genfile->album = getAlbum (tag);
+  genfile->genre = getGenre (tag);
+  genfile->date = getYear (tag);
+  genfile->usecount = 0;
+
+  /* If there is a songlength tag it will take
+   * precedence over any length calculated from
+   * the bitrate and filesize */
+  songlen = getSonglen (tag);
+  if (songlen > 0)
     {
-      LIBMTP_playlist_t *playlist;
-      check_playlists ();
-      playlist = playlists;
-      while (playlist != NULL)
-	{
-	  gchar *tmppath;
-	  tmppath = g_strconcat ("/Playlists/", playlist->name, ".m3u", NULL);
-	  if (g_ascii_strcasecmp (path, tmppath) == 0)
-	    {
-	      int filesize = 0;
-	      int i;
-	      for (i = 0; i < playlist->no_tracks; i++)
-		{
-		  LIBMTP_file_t *file;
-		  LIBMTP_folder_t *folder;
-		  file =
-		    LIBMTP_Get_Filemetadata (device, playlist->tracks[i]);
-		  if (file != NULL)
-		    {
-		      int parent_id = file->parent_id;
-		      filesize = filesize + strlen (file->filename) + 2;
-		      while (parent_id != 0)
-			{
-			  check_folders ();
-			  folder =
-			    LIBMTP_Find_Folder
-			    (storageArea[storageid].folders, parent_id);
-			  if (folder == NULL)
-			    {
-			      DBG ("could not find %d in storage-area %d",
-				   parent_id, storageid);
-			      return -ENOENT;
-			    }
-			  parent_id = folder->parent_id;
-			  filesize = filesize + strlen (folder->name) + 1;
-			}
-		    }
-		}
-	      stbuf->st_mode = S_IFREG | 0777;
-	      stbuf->st_size = filesize;
-	      stbuf->st_blocks = 2;
-	      stbuf->st_mtime = time (NULL);
-	      return 0;
-	    }
-	  playlist = playlist->next;
-	}
-      return -ENOENT;
+      genfile->duration = songlen * 1000;
     }
-
-  if (strncasecmp (path, "/lost+found", 11) == 0)
+  else
     {
-      GSList *item;
-      int item_id = parse_path (path);
-      for (item = lostfiles; item != NULL; item = g_slist_next (item))
-	{
-	  LIBMTP_file_t *file = (LIBMTP_file_t *) item->data;
-
-	  if (item_id == file->item_id)
-	    {
-	      stbuf->st_ino = item_id;
-	      stbuf->st_size = file->filesize;
-	      stbuf->st_blocks = (file->filesize / 512) +
-		(file->filesize % 512 > 0 ? 1 : 0);
-	      stbuf->st_nlink = 1;
-	      stbuf->st_mode = S_IFREG | 0777;
-	      stbuf->st_mtime = file->modificationdate;
-	      return 0;
-	    }
-	}
-
-      return -ENOENT;
+      genfile->duration = (uint16_t) calc_length (fd) * 1000;
+      //genfile->duration = 293000;
     }
 
-  int item_id = -1;
-  check_folders ();
-  item_id =
-    lookup_folder_id (storageArea[storageid].folders, (gchar *) path, NULL);
-  if (item_id >= 0)
+  tracknum = getTracknum (tag);
+  if (tracknum != NULL)
     {
-      // Must be a folder
-      stbuf->st_ino = item_id;
-      stbuf->st_mode = S_IFDIR | 0777;
-      stbuf->st_nlink = 2;
+      genfile->tracknumber = strtoul (tracknum, NULL, 10);
     }
   else
     {
-      // Must be a file
-      item_id = parse_path (path);
-      LIBMTP_file_t *file;
-      DBG ("id:path=%d:%s", item_id, path);
-      check_files ();
-      file = files;
-      gboolean found = FALSE;
-      while (file != NULL)
+      genfile->tracknumber = 0;
+    }
+  g_free (tracknum);
+  id3_file_close (id3_fh);
+
+  // Compensate for missing tag information
+  if (!genfile->artist)
+    genfile->artist = g_strdup ("<Unknown>");
+  if (!genfile->title)
+    genfile->title = g_strdup ("<Unknown>");
+  if (!genfile->album)
+    genfile->album = g_strdup ("<Unknown>");
+  if (!genfile->genre)
+    genfile->genre = g_strdup ("<Unknown>");
+
+  genfile->filesize = job->filesize;
+  genfile->filetype = job->filetype;
+  genfile->filename = g_strdup (filename);
+  return genfile;
+}
+#endif
+
+/* Work that needs no device, done while the previous file is sent */
+static void
+prepare_upload (gpointer data, gpointer user_data)
+{
+  QueuedUpload *job = data;
+#ifdef USEMAD
+  if (job->filetype == LIBMTP_FILETYPE_MP3)
+    job->track = read_track (job, strrchr (job->path, '/') + 1);
+#endif
+  g_async_queue_push (upload_queue, job);
+}
+
+/* Send a staged file.  Called with the device lock held. */
+static int
+send_queued (QueuedUpload * job)
+{
+  MTPPath mp;
+  int parent_id;
+  int storageid;
+  const gchar *filename;
+  int ret;
+  int fd = fileno (job->file);
+
+  if (!split_path (&mp, job->path))
+    return -ENOENT;
+  // Replaced files go first, so the device never holds two of a name.
+  // Whatever is at the path now goes, which may not be the object that
+  // was opened if the path was replaced again since.
+  if (job->replace_id != 0)
+    {
+      int current = parse_path (job->path);
+      if (current > 0)
 	{
-	  if (file->item_id == item_id)
+	  ret = LIBMTP_Delete_Object (device, current);
+	  if (ret != 0)
 	    {
-	      stbuf->st_ino = item_id;
-	      stbuf->st_size = file->filesize;
-	      stbuf->st_blocks = (file->filesize / 512) +
-		(file->filesize % 512 > 0 ? 1 : 0);
-	      stbuf->st_nlink = 1;
-	      stbuf->st_mode = S_IFREG | 0777;
-	      DBG ("time:%s", ctime (&(file->modificationdate)));
-	      stbuf->st_mtime = file->modificationdate;
-	      stbuf->st_ctime = file->modificationdate;
-	      stbuf->st_atime = file->modificationdate;
-	      found = TRUE;
+	      LIBMTP_Dump_Errorstack (device);
+	      LIBMTP_Clear_Errorstack (device);
+	      return ret;
 	    }
-	  file = file->next;
+	  remove_file (current);
 	}
-      if (!found)
+    }
+  storageid = mp.storageid;
+  filename = mp.name;
+  parent_id = resolve_parent (&mp);
+  if (parent_id < 0)
+    parent_id = 0;
+  DBG ("%s:%d", filename, parent_id);
+  lseek (fd, 0, SEEK_SET);
+
+#ifdef USEMAD
+  if (job->track != NULL)
+    {
+      LIBMTP_track_t *genfile = job->track;
+      genfile->parent_id = (uint32_t) parent_id;
+      genfile->storage_id = storageArea[storageid].storage->id;
+      //title,artist,genre,album,date,tracknumber,duration,samplerate,nochannels,wavecodec,bitrate,bitratetype,rating,usecount
+      ret = LIBMTP_Send_Track_From_File_Descriptor (device, fd, genfile,
+						    NULL, NULL);
+      if (ret == 0)
 	{
-	  ret = -ENOENT;
+	  LIBMTP_file_t *newfile;
+	  newfile = LIBMTP_new_file_t ();
+	  newfile->item_id = genfile->item_id;
+	  newfile->parent_id = genfile->parent_id;
+	  newfile->storage_id = genfile->storage_id;
+	  newfile->filename = g_strdup (genfile->filename);
+	  newfile->filesize = genfile->filesize;
+	  newfile->filetype = genfile->filetype;
+	  newfile->modificationdate = time (NULL);
+	  add_file (newfile);
 	}
+      DBG ("Sent TRACK %s", job->path);
+      return ret;
     }
-
+#endif
+  LIBMTP_file_t *genfile;
+  genfile = LIBMTP_new_file_t ();
+  genfile->filesize = job->filesize;
+  genfile->filetype = job->filetype;
+  genfile->filename = g_strdup (filename);
+  genfile->parent_id = (uint32_t) parent_id;
+  genfile->storage_id = storageArea[storageid].storage->id;
+
+  ret = LIBMTP_Send_File_From_File_Descriptor (device, fd, genfile,
+					       NULL, NULL);
+  if (ret == 0)
+    {
+      genfile->modificationdate = time (NULL);
+      add_file (genfile);
+    }
+  else
+    {
+      LIBMTP_destroy_file_t (genfile);
+    }
+  DBG ("Sent FILE %s", job->path);
   return ret;
 }
 
-static int
-mtpfs_getattr (const gchar * path, struct stat *stbuf)
-{
-  enter_lock ("getattr %s", path);
-
-  int ret = mtpfs_getattr_real (path, stbuf);
-
-  DBG ("getattr exit");
-  return_unlock (ret);
-}
-
-static int
-mtpfs_mknod (const gchar * path, mode_t mode, dev_t dev)
-{
-  enter_lock ("mknod %s", path);
-  int item_id = parse_path (path);
-  if (item_id > 0)
-    return_unlock (-EEXIST);
-  myfiles = g_slist_append (myfiles, (gpointer) (g_strdup (path)));
-  DBG ("NEW FILE");
-  return_unlock (0);
-}
-
-static int
-mtpfs_open (const gchar * path, struct fuse_file_info *fi)
+/* Keep the contents of a file that could not be sent in the staging
+ * directory, so a failed send does not lose them */
+static void
+keep_unsent (QueuedUpload * job)
 {
-  enter_lock ("open");
-  int item_id = -1;
-  item_id = parse_path (path);
-  if (item_id < 0)
-    return_unlock (-ENOENT);
+  gchar buf[65536];
+  gchar *name;
+  off_t offset = 0;
+  ssize_t n;
+  int fd;
 
-  switch (fi->flags & O_ACCMODE)
+  name = g_strdup_printf ("%s/unsent-XXXXXX-%s", staging_dir,
+			  strrchr (job->path, '/') + 1);
+  fd = g_mkstemp (name);
+  if (fd == -1)
     {
-    case O_RDONLY:
-      DBG ("read");
-      break;
-    case O_WRONLY:
-      DBG ("write");
-      break;
-    case O_RDWR:
-      DBG ("rdwrite");
-      break;
-    default:
-      DBG ("unexpected access mode: %d", fi->flags & O_ACCMODE);
+      g_warning ("could not send %s, and could not keep a copy", job->path);
+      g_free (name);
+      return;
     }
-
-  int storageid;
-  storageid = find_storage (path);
-  if (storageid < 0)
+  while ((n = pread (fileno (job->file), buf, sizeof (buf), offset)) > 0)
     {
-      return_unlock (-ENOENT);
+      if (write (fd, buf, n) != n)
+	{
+	  n = -1;
+	  break;
+	}
+      offset += n;
     }
-  FILE *filetmp = tmpfile ();
-  int tmpfile = fileno (filetmp);
-  if (tmpfile != -1)
+  close (fd);
+  if (n < 0)
+    g_warning ("could not send %s, and could not keep a copy", job->path);
+  else
+    g_warning ("could not send %s, kept as %s", job->path, name);
+  g_free (name);
+}
+
+/* Send the queued files back to back, until the end marker */
+static gpointer
+run_uploader (gpointer data)
+{
+  QueuedUpload *job;
+  while ((job = g_async_queue_pop (upload_queue)) != &upload_queue_end)
     {
-      if (item_id == 0)
+      GSList *item;
+      int ret;
+
+      enter_lock ("upload %s", job->path);
+      ret = send_queued (job);
+      if (ret == 0)
 	{
-	  fi->fh = tmpfile;
+	  DBG ("Sent %s", job->path);
 	}
-      else if (strncmp ("/Playlists/", path, 11) == 0)
+      else
 	{
-	  // Is a playlist
-	  gchar **fields;
-	  fields = g_strsplit (path, "/", -1);
-	  gchar *name;
-	  name = g_strndup (fields[2], strlen (fields[2]) - 4);
-	  g_strfreev (fields);
-	  fi->fh = tmpfile;
-	  LIBMTP_playlist_t *playlist;
-	  check_playlists ();
-	  playlist = playlists;
-	  while (playlist != NULL)
-	    {
-	      if (g_ascii_strcasecmp (playlist->name, name) == 0)
-		{
-		  //int playlist_id=playlist->playlist_id;
-		  int i;
-		  for (i = 0; i < playlist->no_tracks; i++)
-		    {
-		      LIBMTP_file_t *file;
-		      LIBMTP_folder_t *folder;
-		      file =
-			LIBMTP_Get_Filemetadata (device, playlist->tracks[i]);
-		      if (file != NULL)
-			{
-			  gchar *path;
-			  path = (gchar *) g_malloc (1024);
-			  path = strcpy (path, "/");
-			  int parent_id = file->parent_id;
-			  while (parent_id != 0)
-			    {
-			      check_folders ();
-			      folder =
-				LIBMTP_Find_Folder
-				(storageArea[storageid].folders, parent_id);
-			      path = strcat (path, folder->name);
-			      path = strcat (path, "/");
-			      parent_id = folder->parent_id;
-			    }
-			  path = strcat (path, file->filename);
-			  fprintf (filetmp, "%s\n", path);
-			  DBG ("%s\n", path);
-			}
-		    }
-		  //LIBMTP_destroy_file_t(file);
-		  fflush (filetmp);
-		  break;
-		}
-	      playlist = playlist->next;
-	    }
+	  DBG ("Problem sending %s - %d", job->path, ret);
+	  // The object may or may not exist after a failed send, so refresh
+	  files_changed = TRUE;
 	}
-      else
+      item = g_slist_find_custom (myfiles, job->path, (GCompareFunc) strcmp);
+      if (item != NULL)
 	{
-	  int ret = LIBMTP_Get_File_To_File_Descriptor (device, item_id,
-							tmpfile,
-							NULL, NULL);
-	  if (ret == 0)
-	    {
-	      fi->fh = tmpfile;
-	    }
-	  else
-	    {
-	      return_unlock (-ENOENT);
-	    }
+	  g_free (item->data);
+	  myfiles = g_slist_delete_link (myfiles, item);
 	}
+      // Out of the queue before publishing, so the pending sizes go
+      g_mutex_lock (&upload_queue_lock);
+      queued_bytes -= job->filesize;
+      if (g_hash_table_lookup (queued_uploads, job->path) == job)
+	g_hash_table_remove (queued_uploads, job->path);
+      g_mutex_unlock (&upload_queue_lock);
+      myfiles_version++;
+      publish_snapshot ();
+      g_mutex_unlock (&device_lock);
+      if (ret != 0)
+	keep_unsent (job);
+
+      g_mutex_lock (&upload_queue_lock);
+      job->done = TRUE;
+      job->result = ret;
+      unref_queued (job);
+      g_cond_broadcast (&upload_queue_cond);
+      g_mutex_unlock (&upload_queue_lock);
     }
-  else
+  return NULL;
+}
+
+/* Hand a released new file to the uploader, taking over its staged
+ * copy */
+static void
+queue_upload (const gchar * path, MTPHandle * handle)
+{
+  QueuedUpload *job;
+  struct stat st;
+
+  job = g_new0 (QueuedUpload, 1);
+  job->path = g_strdup (path);
+  job->file = handle->file;
+  fstat (handle->fd, &st);
+  job->filesize = (uint64_t) st.st_size;
+  job->filetype = find_filetype (strrchr (path, '/') + 1);
+  job->replace_id = handle->replace_id;
+  job->refs = 1;
+  handle->file = NULL;
+  handle->fd = -1;
+
+  g_mutex_lock (&upload_queue_lock);
+  if (queued_uploads == NULL)
+    queued_uploads = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_replace (queued_uploads, job->path, job);
+  queued_bytes += job->filesize;
+  g_mutex_unlock (&upload_queue_lock);
+  // Listings pick up its size
+  myfiles_version++;
+  DBG ("Queued %s", path);
+  g_thread_pool_push (upload_preparer, job, NULL);
+}
+
+/* Size of a file waiting in the queue, or 0 */
+static uint64_t
+queued_size (const gchar * path)
+{
+  QueuedUpload *job = NULL;
+  uint64_t size = 0;
+  g_mutex_lock (&upload_queue_lock);
+  if (queued_uploads != NULL)
+    job = g_hash_table_lookup (queued_uploads, path);
+  if (job != NULL)
+    size = job->filesize;
+  g_mutex_unlock (&upload_queue_lock);
+  return size;
+}
+
+/* Wait until a queued file has been sent.  Returns -EIO if it failed. */
+static int
+wait_queued_upload (const gchar * path)
+{
+  QueuedUpload *job = NULL;
+  int ret = 0;
+  g_mutex_lock (&upload_queue_lock);
+  if (queued_uploads != NULL)
+    job = g_hash_table_lookup (queued_uploads, path);
+  if (job != NULL)
     {
-      return_unlock (-ENOENT);
+      job->refs++;
+      while (!job->done)
+	g_cond_wait (&upload_queue_cond, &upload_queue_lock);
+      ret = (job->result == 0) ? 0 : -EIO;
+      unref_queued (job);
     }
+  g_mutex_unlock (&upload_queue_lock);
+  return ret;
+}
 
-  return_unlock (0);
+/* Stop taking new files and send everything still queued */
+static void
+drain_uploads ()
+{
+  if (upload_preparer == NULL)
+    return;
+  g_thread_pool_free (upload_preparer, FALSE, TRUE);
+  upload_preparer = NULL;
+  g_async_queue_push (upload_queue, &upload_queue_end);
+  g_thread_join (uploader);
+  g_async_queue_unref (upload_queue);
 }
 
+/* Wait until everything written to a streamed file has been handed to
+ * the device.  Returns -EIO if the send has failed. */
 static int
-mtpfs_read (const gchar * path, gchar * buf, size_t size, off_t offset,
-	    struct fuse_file_info *fi)
+sync_upload (Upload * upload)
 {
-  enter_lock ("read");
   int ret;
+  g_mutex_lock (&upload->lock);
+  while (upload->sent < upload->written && !upload->failed
+	 && !upload->finished)
+    g_cond_wait (&upload->cond, &upload->lock);
+  ret = upload->failed ? -EIO : 0;
+  g_mutex_unlock (&upload->lock);
+  return ret;
+}
 
-  int item_id = -1;
-  item_id = parse_path (path);
-  if (item_id < 0)
-    return_unlock (-ENOENT);
-
-  ret = pread (fi->fh, buf, size, offset);
-  if (ret == -1)
-    ret = -errno;
-
+/* Save a new playlist on close, so an error reaches the program */
+static int
+flush_playlist (const char *path, MTPHandle * handle)
+{
+  GSList *item;
+  int ret = 0;
+  enter_lock ("flush playlist %s", path);
+  item = g_slist_find_custom (myfiles, path, (GCompareFunc) strcmp);
+  if (item != NULL && !handle->saved)
+    {
+      ret = save_playlist (path, handle->fd);
+      handle->saved = TRUE;
+    }
   return_unlock (ret);
 }
 
 static int
-mtpfs_write (const gchar * path, const gchar * buf, size_t size, off_t offset,
-	     struct fuse_file_info *fi)
+mtpfs_flush (const char *path, struct fuse_file_info *fi)
 {
-  enter_lock ("write");
-  int ret;
-  if (fi->fh != -1)
+  MTPHandle *handle = HANDLE (fi);
+  if (handle->file != NULL && strncmp ("/Playlists/", path, 11) == 0)
+    return flush_playlist (path, handle);
+  // Errors from release are not seen, so a failed stream shows here
+  if (handle->upload != NULL)
+    return sync_upload (handle->upload);
+  if (handle->editing)
+    return flush_edit (handle);
+  // Errors from release are not seen, so fill a replacement in here
+  if (handle->replace_id != 0 && handle->dirty && !handle->complete)
     {
-      ret = pwrite (fi->fh, buf, size, offset);
+      int ret;
+      g_mutex_lock (&handle->lock);
+      ret = handle->complete ? 0 : fetch_old_contents (handle);
+      g_mutex_unlock (&handle->lock);
+      if (ret < 0)
+	return ret;
     }
-  else
+  return wait_queued_upload (path);
+}
+
+static int
+mtpfs_fsync (const char *path, int datasync, struct fuse_file_info *fi)
+{
+  MTPHandle *handle = HANDLE (fi);
+  int ret;
+  if (handle->upload != NULL)
+    return sync_upload (handle->upload);
+  ret = flush_edit (handle);
+  if (ret < 0)
+    return ret;
+  return wait_queued_upload (path);
+}
+
+/* Setting the size of a new, empty file tells how much is coming, so it
+ * can be sent as it is written */
+static int
+mtpfs_ftruncate (const char *path, off_t size, struct fuse_file_info *fi)
+{
+  MTPHandle *handle = HANDLE (fi);
+  StagedFile *staged;
+  int ret;
+  if (handle->upload != NULL)
+    return (size == handle->upload->size) ? 0 : -EINVAL;
+  if (handle->created && size > 0 && start_upload (path, handle, size))
+    return 0;
+  if (handle->editing)
+    return edit_truncate (handle, size);
+  if (handle->file == NULL)
+    return -EBADF;
+  if (handle->replace_id != 0)
     {
-      ret = -ENOENT;
+      ret = 0;
+      g_mutex_lock (&handle->lock);
+      handle->dirty = TRUE;
+      // Cutting at or before what has been written leaves nothing to fetch
+      if (!handle->complete && (uint64_t) size <= handle->filled)
+	handle->complete = TRUE;
+      else if (!handle->complete)
+	ret = fetch_old_contents (handle);
+      g_mutex_unlock (&handle->lock);
+      if (ret < 0)
+	return ret;
     }
+  staged = stage_resize (handle->fd, size, FALSE, &ret);
+  if (ret < 0)
+    return ret;
+  if (ftruncate (handle->fd, size) == -1)
+    ret = -errno;
+  if (staged != NULL)
+    g_rw_lock_reader_unlock (&staged->lock);
+  return ret;
+}
 
-  return_unlock (ret);
+/* truncate of a path that is not open, through a handle of our own, so
+ * it is edited in place or replaced like any other change */
+static int
+mtpfs_truncate (const char *path, off_t size)
+{
+  struct fuse_file_info fi;
+  int ret, release_ret;
+  memset (&fi, 0, sizeof (fi));
+  fi.flags = O_WRONLY;
+  ret = mtpfs_open (path, &fi);
+  if (ret < 0)
+    return ret;
+  ret = mtpfs_ftruncate (path, size, &fi);
+  release_ret = mtpfs_release (path, &fi);
+  return ret < 0 ? ret : release_ret;
+}
+
+static int
+mtpfs_fallocate (const char *path, int mode, off_t offset, off_t length,
+		 struct fuse_file_info *fi)
+{
+  MTPHandle *handle = HANDLE (fi);
+  if (mode != 0)
+    return -EOPNOTSUPP;
+  if (handle->upload != NULL)
+    return (offset + length <= handle->upload->size) ? 0 : -ENOSPC;
+  if (handle->created && offset == 0 && length > 0
+      && start_upload (path, handle, offset + length))
+    return 0;
+  return -EOPNOTSUPP;
 }
 
 static int
 mtpfs_unlink (const gchar * path)
 {
+  wait_queued_upload (path);
   enter_lock ("unlink");
   int ret = 0;
   int item_id = -1;
@@ -1349,9 +4798,9 @@ mtpfs_unlink (const gchar * path)
     {
       playlists_changed = TRUE;
     }
-  else
+  else if (ret == 0)
     {
-      files_changed = TRUE;
+      remove_file (item_id);
     }
 
   return_unlock (ret);
@@ -1361,68 +4810,45 @@ static int
 mtpfs_mkdir_real (const char *path, mode_t mode)
 {
   if (g_str_has_prefix (path, "/.Trash") == TRUE)
-    return_unlock (-EPERM);
+    return -EPERM;
 
   int ret = 0;
   GSList *item;
+  MTPPath mp;
   item = g_slist_find_custom (myfiles, path, (GCompareFunc) strcmp);
-  int item_id = parse_path (path);
-  int storageid = find_storage (path);
-  if (storageid < 0)
+  if (!split_path (&mp, path))
     {
-      return_unlock (-ENOENT);
+      return -ENOENT;
     }
-  if ((item == NULL) && (item_id < 0))
+  int storageid = mp.storageid;
+  if ((item == NULL) && (mp.parent_length > 0)
+      && (resolve_path (&mp) == NULL))
     {
-      // Split path and find parent_id
-      gchar *filename = g_strdup ("");
-      gchar **fields;
-      gchar *directory;
-
-      directory = (gchar *) g_malloc (strlen (path) + 1);
-      directory = strcpy (directory, "/");
-      fields = g_strsplit (path, "/", -1);
-      int i;
-      uint32_t parent_id = 0;
-      for (i = 0; fields[i] != NULL; i++)
-	{
-	  if (strlen (fields[i]) > 0)
-	    {
-	      if (fields[i + 1] == NULL)
-		{
-		  gchar *tmp = g_strndup (directory,
-					  strlen (directory) - 1);
-		  check_folders ();
-		  parent_id =
-		    lookup_folder_id (storageArea
-				      [storageid].folders, tmp, NULL);
-		  g_free (tmp);
-		  if (parent_id < 0)
-		    parent_id = 0;
-		  g_free (filename);
-		  filename = g_strdup (fields[i]);
-		}
-	      else
-		{
-		  directory = strcat (directory, fields[i]);
-		  directory = strcat (directory, "/");
-		}
-	    }
-	}
-      DBG ("%s:%s:%d", filename, directory, parent_id);
-      ret = LIBMTP_Create_Folder (device, filename, parent_id, 0);
-      g_strfreev (fields);
-      g_free (directory);
-      g_free (filename);
-      if (ret == 0)
+      // Find parent_id
+      gchar *filename = g_strdup (mp.name);
+      int parent_id = resolve_parent (&mp);
+      if (parent_id < 0)
+	parent_id = 0;
+      DBG ("%s:%d", filename, parent_id);
+      uint32_t folder_id;
+      folder_id = LIBMTP_Create_Folder (device, filename, parent_id,
+					storageArea[storageid].storage->id);
+      if (folder_id == 0)
 	{
 	  ret = -EEXIST;
 	}
       else
 	{
-	  storageArea[storageid].folders_changed = TRUE;
+	  // The device may have altered the name to suit its character set
+	  add_folder (storageid, folder_id, parent_id, filename);
+	  if (listing_on_demand () && listed_folders != NULL)
+	    {
+	      // Nothing to fetch for a folder we have just created
+	      g_hash_table_add (listed_folders, GUINT_TO_POINTER (folder_id));
+	    }
 	  ret = 0;
 	}
+      g_free (filename);
     }
   else
     {
@@ -1455,14 +4881,23 @@ mtpfs_rmdir (const char *path)
     {
       return_unlock (-ENOENT);
     }
-  folder_id =
-    lookup_folder_id (storageArea[storageid].folders, (gchar *) path, NULL);
-  if (folder_id < 0)
+  MTPObject *object;
+  object = lookup_path (path);
+  if (object == NULL || object->folder == NULL)
     return_unlock (-ENOENT);
+  list_object (object);
+  if (object->children->len > 0)
+    return_unlock (-ENOTEMPTY);
+  folder_id = object->id;
 
-  LIBMTP_Delete_Object (device, folder_id);
+  ret = LIBMTP_Delete_Object (device, folder_id);
+  if (ret != 0)
+    {
+      dump_mtp_error ();
+      return_unlock (-EIO);
+    }
 
-  storageArea[storageid].folders_changed = TRUE;
+  remove_folder (storageid, folder_id);
   return_unlock (ret);
 }
 
@@ -1514,8 +4949,6 @@ mtpfs_rename (const char *oldname, const char *newname)
   int folder_id = -1, parent_id;
   int folder_empty = 1;
   int ret = -ENOTEMPTY;
-  LIBMTP_folder_t *folder;
-  LIBMTP_file_t *file;
 
   int storageid_old = find_storage (oldname);
   if (storageid_old < 0)
@@ -1529,94 +4962,106 @@ mtpfs_rename (const char *oldname, const char *newname)
     }
   if (strcmp (oldname, "/") != 0)
     {
-      folder_id =
-	lookup_folder_id (storageArea[storageid_old].folders,
-			  (gchar *) oldname, NULL);
+      folder_id = lookup_folder_id (oldname);
     }
   if (folder_id < 0)
     return_unlock (-ENOENT);
 
-  check_folders ();
-  folder = LIBMTP_Find_Folder (storageArea[storageid_old].folders, folder_id);
+  MTPObject *object;
+  object = lookup_path (oldname);
 
   /* MTP Folder object not found? */
-  if (folder == NULL)
+  if (object == NULL || object->folder == NULL)
     return_unlock (-ENOENT);
 
-  parent_id = folder->parent_id;
-  folder = folder->child;
+  parent_id = object->parent_id;
 
   /* Check if empty folder */
-  DBG ("Checking empty folder start for: subfolders");
-
-  while (folder != NULL)
-    {
-      if (folder->parent_id == folder_id)
-	{
-	  folder_empty = 0;
-	  break;
-	}
-      folder = folder->sibling;
-    }
-
-  DBG ("Checking empty folder end for: subfolders. Result: %s",
+  list_object (object);
+  folder_empty = (object->children->len == 0);
+  DBG ("Checking empty folder %d. Result: %s", folder_id,
        (folder_empty == 1 ? "empty" : "not empty"));
 
+  /* Rename folder. First remove old folder, then create the new one */
   if (folder_empty == 1)
     {
-      /* Find files */
-      check_files ();
-      DBG ("Checking empty folder start for: files");
-      file = files;
-      while (file != NULL)
-	{
-	  if (file->parent_id == folder_id)
-	    {
-	      folder_empty = 0;
-	      break;
-	    }
-	  file = file->next;
-	}
-      DBG ("Checking empty folder end for: files. Result: %s",
-	   (folder_empty == 1 ? "empty" : "not empty"));
-
-      /* Rename folder. First remove old folder, then create the new one */
-      if (folder_empty == 1)
+      struct stat stbuf;
+      if ((ret = mtpfs_getattr_real (oldname, &stbuf)) == 0)
 	{
-	  struct stat stbuf;
-	  if ((ret = mtpfs_getattr_real (oldname, &stbuf)) == 0)
-	    {
-	      DBG ("removing folder %s, id %d", oldname, folder_id);
+	  DBG ("removing folder %s, id %d", oldname, folder_id);
 
-	      ret = mtpfs_mkdir_real (newname, stbuf.st_mode);
-	      LIBMTP_Delete_Object (device, folder_id);
-	      storageArea[storageid_old].folders_changed = TRUE;
-	      storageArea[storageid_new].folders_changed = TRUE;
-	    }
+	  ret = mtpfs_mkdir_real (newname, stbuf.st_mode);
+	  if (LIBMTP_Delete_Object (device, folder_id) == 0)
+	    remove_folder (storageid_old, folder_id);
+	  else
+	    storageArea[storageid_old].folders_changed = TRUE;
 	}
     }
   return_unlock (ret);
 }
 
 static int
-mtpfs_statfs (const char *path, struct statfs *stbuf)
+mtpfs_statfs (const char *path, struct statvfs *stbuf)
 {
+  uint64_t pending;
   DBG ("mtpfs_statfs");
   stbuf->f_bsize = 1024;
+  stbuf->f_frsize = 1024;
   stbuf->f_blocks = device->storage->MaxCapacity / 1024;
   stbuf->f_bfree = device->storage->FreeSpaceInBytes / 1024;
   stbuf->f_ffree = device->storage->FreeSpaceInObjects / 1024;
+  // Files waiting to be sent will take their share soon
+  g_mutex_lock (&upload_queue_lock);
+  pending = queued_bytes / 1024;
+  g_mutex_unlock (&upload_queue_lock);
+  stbuf->f_bfree -= MIN (pending, stbuf->f_bfree);
   stbuf->f_bavail = stbuf->f_bfree;
+  g_mutex_lock (&staging_lock);
+  DBG ("staging %" G_GUINT64_FORMAT " bytes, %" G_GUINT64_FORMAT
+       " in memory, %" G_GUINT64_FORMAT " waiting to be sent",
+       staged_bytes, staged_memory_bytes, pending * 1024);
+  g_mutex_unlock (&staging_lock);
   return 0;
 }
 
 void *
-mtpfs_init ()
+mtpfs_init (struct fuse_conn_info *conn)
 {
   LIBMTP_devicestorage_t *storage;
   DBG ("mtpfs_init");
+  // Let read_buf replies splice from the backing files
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+  // O_TRUNC reaches open, so overwriting a file skips fetching it
+  conn->want |= conn->capable & FUSE_CAP_ATOMIC_O_TRUNC;
+  // Tags of the next file are read while the current one is sent
+  upload_queue = g_async_queue_new ();
+  upload_preparer = g_thread_pool_new (prepare_upload, NULL, 1, TRUE, NULL);
+  uploader = g_thread_new ("uploader", run_uploader, NULL);
   files_changed = TRUE;
   playlists_changed = TRUE;
+  gboolean complete = TRUE;
+  if (load_index_cache (&complete))
+    {
+      DBG ("Using saved index");
+      // Folders never listed are fetched as they are visited until the
+      // walk has been through them
+      if (!lazy_listing && !complete)
+	warming_up = TRUE;
+      index_walker = g_thread_new ("revalidate", walk_folders,
+				   GINT_TO_POINTER (TRUE));
+    }
+  else if (!lazy_listing)
+    {
+      // Fetch folders as they are visited until the walk has seen them all
+      int i;
+      for (i = 0; i < 4; i++)
+	storageArea[i].folders_changed = FALSE;
+      files_changed = FALSE;
+      index_changed = TRUE;
+      warming_up = TRUE;
+      index_walker = g_thread_new ("warm-up", walk_folders,
+				   GINT_TO_POINTER (FALSE));
+    }
   DBG ("Ready");
   return 0;
 }
@@ -1635,7 +5080,13 @@ static struct fuse_operations mtpfs_oper = {
   .open = mtpfs_open,
   .mknod = mtpfs_mknod,
   .read = mtpfs_read,
+  .read_buf = mtpfs_read_buf,
   .write = mtpfs_write,
+  .flush = mtpfs_flush,
+  .fsync = mtpfs_fsync,
+  .truncate = mtpfs_truncate,
+  .ftruncate = mtpfs_ftruncate,
+  .fallocate = mtpfs_fallocate,
   .unlink = mtpfs_unlink,
   .destroy = mtpfs_destroy,
   .mkdir = mtpfs_mkdir,
@@ -1645,6 +5096,60 @@ static struct fuse_operations mtpfs_oper = {
   .init = mtpfs_init,
 };
 
+/* Pull the mtpfs specific options out of argv, leaving the rest for fuse.
+ * Returns the new argument count. */
+static int
+parse_options (int argc, char *argv[])
+{
+  int i, j;
+  for (i = 1, j = 1; i < argc; i++)
+    {
+      if (strcmp (argv[i], "--lazy") == 0)
+	{
+	  lazy_listing = TRUE;
+	}
+      else if (strcmp (argv[i], "--no-partial-reads") == 0)
+	{
+	  partial_reads = FALSE;
+	}
+      else if (strcmp (argv[i], "--no-edit-objects") == 0)
+	{
+	  edit_objects = FALSE;
+	}
+      else if (strncmp (argv[i], "--cache-dir=", 12) == 0)
+	{
+	  g_free (content_cache_dir);
+	  content_cache_dir = g_strdup (argv[i] + 12);
+	}
+      else if (strncmp (argv[i], "--cache-size=", 13) == 0)
+	{
+	  content_cache_size =
+	    g_ascii_strtoull (argv[i] + 13, NULL, 10) * 1024 * 1024;
+	}
+      else if (strncmp (argv[i], "--staging-dir=", 14) == 0)
+	{
+	  g_free (staging_dir);
+	  staging_dir = g_strdup (argv[i] + 14);
+	}
+      else if (strncmp (argv[i], "--staging-memory=", 17) == 0)
+	{
+	  staging_memory =
+	    g_ascii_strtoull (argv[i] + 17, NULL, 10) * 1024 * 1024;
+	}
+      else if (strncmp (argv[i], "--staging-size=", 15) == 0)
+	{
+	  staging_size =
+	    g_ascii_strtoull (argv[i] + 15, NULL, 10) * 1024 * 1024;
+	}
+      else
+	{
+	  argv[j++] = argv[i];
+	}
+    }
+  argv[j] = NULL;
+  return j;
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -1660,6 +5165,14 @@ main (int argc, char *argv[])
   extern char *optarg;
 
   g_mutex_init(&device_lock);
+  g_mutex_init (&download_lock);
+  g_mutex_init (&snapshot_lock);
+  g_mutex_init (&staging_lock);
+  g_cond_init (&staging_cond);
+  g_mutex_init (&upload_queue_lock);
+  g_cond_init (&upload_queue_cond);
+  g_cond_init (&download_cond);
+  argc = parse_options (argc, argv);
 
   //while ((opt = getopt(argc, argv, "d")) != -1 ) {
   //switch (opt) {
@@ -1749,6 +5262,31 @@ main (int argc, char *argv[])
       g_free (friendlyname);
     }
 
+  /* The saved index is kept per device, by serial number */
+  char *serial = LIBMTP_Get_Serialnumber (device);
+  if (serial != NULL && *serial != '\0')
+    {
+      index_cache_prefix = g_strdup (serial);
+      g_strdelimit (index_cache_prefix, "/\\. ", '_');
+    }
+  g_free (serial);
+
+  /* Copies of files read from the device are kept in the content cache */
+  if (content_cache_dir == NULL)
+    content_cache_dir = g_build_filename (g_get_user_cache_dir (), "mtpfs",
+					  "files", NULL);
+  if (index_cache_prefix == NULL || content_cache_size == 0
+      || g_mkdir_with_parents (content_cache_dir, 0700) != 0)
+    {
+      g_free (content_cache_dir);
+      content_cache_dir = NULL;
+    }
+
+  /* Copies of files being written are staged here once too big for
+   * memory */
+  if (staging_dir == NULL)
+    staging_dir = g_strdup (g_get_tmp_dir ());
+
   /* Get all storages for this device */
   int ret = LIBMTP_Get_Storage (device, LIBMTP_STORAGE_SORTBY_NOTSORTED);
   if (ret != 0)
@@ -1772,9 +5310,31 @@ main (int argc, char *argv[])
 	   storage->StorageDescription);
     }
 
+  /* Read parts of files on demand if the device allows */
+  if (partial_reads)
+    partial_reads =
+      LIBMTP_Check_Capability (device, LIBMTP_DEVICECAP_GetPartialObject);
+  DBG ("Partial reads %s", partial_reads ? "on" : "off");
+  /* libmtp has no capability for GetPartialObject64, but it comes with
+   * the Android extensions that edit objects */
+#ifdef HAVE_LIBMTP_BEGINEDITOBJECT
+  partial_reads_64 = partial_reads
+    && LIBMTP_Check_Capability (device, LIBMTP_DEVICECAP_EditObjects);
+#endif
+
+  /* Change files in place if the device allows */
+#ifdef HAVE_LIBMTP_BEGINEDITOBJECT
+  if (edit_objects)
+    edit_objects =
+      LIBMTP_Check_Capability (device, LIBMTP_DEVICECAP_EditObjects);
+#else
+  edit_objects = FALSE;
+#endif
+  DBG ("In-place edits %s", edit_objects ? "on" : "off");
+
   DBG ("Start fuse");
 
-  fuse_stat = fuse_main (argc, argv, &mtpfs_oper);
+  fuse_stat = fuse_main (argc, argv, &mtpfs_oper, NULL);
   DBG ("fuse_main returned %d\n", fuse_stat);
   return fuse_stat;
 }
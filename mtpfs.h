@@ -5,6 +5,11 @@
 #include "config.h"
 #endif
 
+#ifdef HAVE_MEMFD_CREATE
+/* For memfd_create() */
+#define _GNU_SOURCE
+#endif
+
 #ifdef linux
 /* For pread()/pwrite() */
 #define _XOPEN_SOURCE 500
@@ -17,7 +22,8 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
-#include <sys/statfs.h>
+#include <sys/statvfs.h>
+#include <utime.h>
 
 #include <libmtp.h>
 #include <glib.h>
@@ -34,23 +40,296 @@ typedef struct
   LIBMTP_devicestorage_t *storage;
   LIBMTP_folder_t *folders;
   gboolean folders_changed;
+  GArray *children;		/* ids of objects in the storage root */
+  gboolean listed;		/* lazy mode: root contents fetched */
+  guint generation;		/* bumped when the root's contents change */
 } StorageArea;
 
+/* A file or folder on the device, as seen through the path/object index */
+typedef struct
+{
+  uint32_t id;
+  uint32_t parent_id;
+  int storageid;
+  gchar *path;			/* NULL if the parent folder is unknown */
+  LIBMTP_file_t *file;		/* set for files */
+  LIBMTP_folder_t *folder;	/* set for folders */
+  GArray *children;		/* folders only: ids of objects inside */
+  guint generation;		/* folders only: bumped when children change */
+} MTPObject;
+
+/* A path known not to exist, valid while its parent folder is unchanged */
+typedef struct
+{
+  int storageid;
+  uint32_t parent_id;
+  guint generation;
+} NegativeEntry;
+
+#define NEGATIVE_CACHE_SIZE 4096
+
+/* The m3u text of a playlist, rendered from the index */
+typedef struct
+{
+  guint playlists_version;	/* playlists_version when rendered */
+  guint index_version;		/* index_version when rendered */
+  gsize length;
+  gchar *body;
+} PlaylistRender;
+
+/* Where a track outside the index was found: the track and its folders
+ * up to one that was in the index, or to the root of the storage */
+typedef struct
+{
+  GArray *ids;			/* uint32_t: the track first, empty if not found */
+  GPtrArray *names;		/* the name of each of ids */
+  uint32_t base;		/* folder above the last of ids, 0 for the root */
+  int storageid;
+  guint playlists_version;	/* playlists_version when asked */
+} TrackPath;
+
+/* m3u comment standing for a track whose path could not be found */
+#define PLAYLIST_TRACK_ID "#mtpfs-track:"
+
+/* Metadata of a path as of a snapshot */
+typedef struct
+{
+  uint32_t id;
+  gchar *name;
+  gboolean folder;
+  gboolean listed;		/* folders: the children are complete */
+  gboolean pending;		/* created through the mount, not sent yet */
+  gboolean stale;		/* known to exist, but ask the device */
+  uint64_t size;
+  time_t modified;
+  GPtrArray *children;		/* folders: SnapshotEntry */
+} SnapshotEntry;
+
+/* An immutable copy of the index that getattr and readdir read without
+ * the device lock.  Readers take a reference under snapshot_lock, which
+ * guards only the pointer; changes to the index publish a new snapshot
+ * and the old one goes when its last reader lets go. */
+typedef struct
+{
+  gint refs;
+  GHashTable *paths;		/* case-folded path -> SnapshotEntry */
+  GPtrArray *entries;		/* owns the entries */
+} Snapshot;
+
+/* A path from a request, folded to lower case for the index in a buffer on
+ * the caller's stack.  Lookups of the parent folders terminate the buffer
+ * in place, so resolving a path needs no heap allocation. */
+typedef struct
+{
+  gchar key[PATH_MAX];
+  gsize length;
+  gsize parent_length;		/* key[0, parent_length) is the parent */
+  const gchar *name;		/* last component, as given */
+  int storageid;
+} MTPPath;
+
+/* A file opened for reading straight from the device */
+typedef struct
+{
+  uint32_t id;
+  uint64_t size;
+  uint64_t next_offset;		/* where a sequential read would go on */
+  guint window;			/* chunks to read ahead */
+} RemoteFile;
+
+/* A whole file copied from the device, shared by its read-only handles.
+ * The copy is made in the background; reads wait on download_cond until
+ * the bytes they want have arrived.  Guarded by download_lock. */
+typedef struct
+{
+  uint32_t id;
+  FILE *file;
+  guint refs;			/* handles, plus one while copying */
+  uint64_t size;		/* of the object when it was copied */
+  time_t modified;
+  uint64_t received;
+  gboolean done;
+  gboolean failed;
+  gchar *part;			/* content cache file being written, or NULL */
+} Download;
+
+/* A file in the content cache, while trimming it */
+typedef struct
+{
+  gchar *path;
+  off_t size;
+  time_t used;
+} CacheEntry;
+
+/* A new file sent to the device while it is being written.  Writes fill
+ * a ring buffer that the send drains.  Guarded by its own lock. */
+#define UPLOAD_RING_SIZE (4 * 1024 * 1024)
+#define UPLOAD_STALL_TIMEOUT 30	/* seconds without data before giving up */
+
+typedef struct
+{
+  GMutex lock;
+  GCond cond;
+  guchar *ring;
+  uint64_t size;		/* announced to the device up front */
+  uint64_t written;		/* bytes put into the ring */
+  uint64_t sent;		/* bytes taken out by the send */
+  gboolean closed;		/* the writer has released the file */
+  gboolean failed;
+  gboolean finished;
+  int result;
+  LIBMTP_file_t *file;
+  GThread *thread;
+} Upload;
+
+/* Space held by a staged copy of a file, keyed by its descriptor */
+typedef struct
+{
+  uint64_t size;		/* bytes charged against the budget */
+  gboolean memory;		/* still held in memory */
+  GRWLock lock;			/* writers share it, a spill takes it alone */
+} StagedFile;
+
+#define STAGING_WAIT_TIMEOUT 30	/* seconds a write waits for space */
+
+/* A new file waiting to be sent by the background uploader */
+typedef struct
+{
+  gchar *path;
+  FILE *file;			/* staged contents */
+  uint64_t filesize;
+  LIBMTP_filetype_t filetype;
+#ifdef USEMAD
+  LIBMTP_track_t *track;	/* tags, read while the previous file is sent */
+#endif
+  uint32_t replace_id;		/* object deleted before sending, or 0 */
+  gint refs;			/* guarded by upload_queue_lock */
+  gboolean done;
+  int result;
+} QueuedUpload;
+
+/* An open file, kept in fi->fh.  Reads and writes of a handle with a
+ * backing file need neither the device lock nor the path. */
+typedef struct
+{
+  int fd;			/* backing file, or -1 */
+  FILE *file;			/* stream of a private backing file */
+  RemoteFile *remote;		/* read from the device in chunks */
+  Download *download;		/* shared copy of the file */
+  gboolean created;		/* a new file, not on the device yet */
+  Upload *upload;		/* new file being sent as it is written */
+  uint32_t replace_id;		/* object the contents replace on release */
+  uint64_t old_size;		/* its size */
+  gchar *path;			/* its path, while in replacing */
+  uint64_t filled;		/* bytes written from the start so far */
+  gboolean complete;		/* backing file holds all of the contents */
+  gboolean dirty;		/* written or truncated since open */
+  GMutex lock;			/* guards the above until complete */
+  gboolean saved;		/* new playlists: saved since last written */
+  gboolean editing;		/* writes go straight to the object */
+  GByteArray *edit_buffer;	/* contiguous writes not sent yet */
+  uint64_t edit_offset;		/* where they start */
+} MTPHandle;
+
+#define EDIT_BUFFER_SIZE (1024 * 1024)	/* most sent in one edit */
+
+#define HANDLE(fi) ((MTPHandle *) (uintptr_t) (fi)->fh)
+
+/* A block of a file read from the device, kept in the chunk cache */
+#define CHUNK_SIZE (1024 * 1024)
+#define CHUNK_CACHE_SIZE 64	/* chunks */
+#define READAHEAD_CHUNKS 8	/* largest readahead window */
+#define CHUNK_KEY(id, n) (((guint64) (id) << 32) | (n))
+
+typedef struct
+{
+  guint64 key;			/* CHUNK_KEY (object id, chunk number) */
+  gsize length;
+  guchar *data;
+  GList link;			/* in chunk_lru, most recently used first */
+} Chunk;
+
+/* A chunk queued for reading ahead */
+typedef struct
+{
+  guint64 key;
+  uint64_t size;		/* of the file */
+} ChunkJob;
+
+/* On-disk copy of the folder tree and file list of one storage area,
+ * written at unmount and mapped at the next mount.  The header is followed
+ * by the records, folders before files and every folder after its parent,
+ * and then by a table of NUL terminated names. */
+#define INDEX_MAGIC "MTPFSIDX"
+#define INDEX_VERSION 1
+#define INDEX_FOLDER 0x80000000	/* record flags */
+#define INDEX_LISTED 0x40000000
+#define INDEX_FILETYPE 0x0000ffff
+
+typedef struct
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t storage_id;
+  uint32_t records;
+  uint32_t flags;		/* INDEX_LISTED if the root has been listed */
+  uint64_t strings;		/* size of the name table */
+} IndexHeader;
+
+typedef struct
+{
+  uint32_t id;
+  uint32_t parent_id;
+  uint32_t name;		/* offset into the name table */
+  uint32_t flags;
+  uint64_t filesize;
+  int64_t modificationdate;
+} IndexRecord;
+
 /* Function declarations */
 
 /* local functions */
 static LIBMTP_filetype_t find_filetype (const gchar * filename);
-static int lookup_folder_id (LIBMTP_folder_t * folderlist, gchar * path,
-			     gchar * parent);
+static int lookup_folder_id (const gchar * path);
 static int parse_path (const gchar * path);
 static void check_lost_files ();
 void check_folders ();
+static void check_index ();
+static MTPObject *lookup_path (const gchar * path);
+static gboolean split_path (MTPPath * mp, const gchar * path);
+static MTPObject *resolve_path (MTPPath * mp);
+static int resolve_parent (MTPPath * mp);
+static void list_folder (int storageid, uint32_t folder_id);
+static void list_object (MTPObject * object);
 static int find_storage (const gchar * path);
+static int find_storage_by_id (uint32_t storage_id);
+static void drop_chunks (uint32_t id);
+static void close_handle (MTPHandle * handle);
+static int finish_upload (Upload * upload);
+static FILE *stage_open (uint64_t size);
+static void stage_close (FILE * file);
+static int fetch_old_contents (MTPHandle * handle);
+static int end_edit (MTPHandle * handle);
+static int flush_edit (MTPHandle * handle);
+static void queue_upload (const gchar * path, MTPHandle * handle);
+static void drain_uploads ();
+static void forget_file_links ();
+static uint64_t queued_size (const gchar * path);
+static int wait_queued_upload (const gchar * path);
+static void publish_snapshot ();
 
     /* fuse functions */
-static void *mtpfs_init (void);
+static void *mtpfs_init (struct fuse_conn_info *conn);
 static int mtpfs_blank (const char *path, mode_t mode);
 static int mtpfs_release (const char *path, struct fuse_file_info *fi);
+static int mtpfs_flush (const char *path, struct fuse_file_info *fi);
+static int mtpfs_fsync (const char *path, int datasync,
+			struct fuse_file_info *fi);
+static int mtpfs_truncate (const char *path, off_t size);
+static int mtpfs_ftruncate (const char *path, off_t size,
+			    struct fuse_file_info *fi);
+static int mtpfs_fallocate (const char *path, int mode, off_t offset,
+			    off_t length, struct fuse_file_info *fi);
 void mtpfs_destroy (void *buf);
 static int mtpfs_readdir (const gchar * path, void *buf,
 			  fuse_fill_dir_t filler, off_t offset,
@@ -60,22 +339,82 @@ static int mtpfs_mknod (const gchar * path, mode_t mode, dev_t dev);
 static int mtpfs_open (const gchar * path, struct fuse_file_info *fi);
 static int mtpfs_read (const gchar * path, gchar * buf, size_t size,
 		       off_t offset, struct fuse_file_info *fi);
+static int mtpfs_read_buf (const gchar * path, struct fuse_bufvec **bufp,
+			   size_t size, off_t offset,
+			   struct fuse_file_info *fi);
 static int mtpfs_write (const gchar * path, const gchar * buf, size_t size,
 			off_t offset, struct fuse_file_info *fi);
 static int mtpfs_unlink (const gchar * path);
 static int mtpfs_mkdir (const char *path, mode_t mode);
 static int mtpfs_rmdir (const char *path);
-static int mtpfs_statfs (const char *path, struct statfs *stbuf);
+static int mtpfs_statfs (const char *path, struct statvfs *stbuf);
 int calc_length (int f);
 
 static LIBMTP_mtpdevice_t *device;
 static StorageArea storageArea[4];
 static LIBMTP_file_t *files = NULL;
+static GHashTable *file_prev = NULL;	/* item_id -> file before it, or NULL */
 static gboolean files_changed = TRUE;
 static GSList *lostfiles = NULL;
 static GSList *myfiles = NULL;
 static LIBMTP_playlist_t *playlists = NULL;
 static gboolean playlists_changed = FALSE;
+static guint playlists_version = 0;
+static GHashTable *playlist_renders = NULL;
+static GHashTable *replacing = NULL;	/* path -> open replacement MTPHandle */
+static GHashTable *track_paths = NULL;
 static GMutex device_lock;
+static GHashTable *path_index = NULL;
+static GHashTable *object_index = NULL;
+static gboolean index_changed = TRUE;
+static guint index_version = 0;
+static gboolean lazy_listing = FALSE;
+static GHashTable *listed_folders = NULL;
+static GHashTable *negative_paths = NULL;
+static gchar *index_cache_prefix = NULL;
+static gboolean warming_up = FALSE;
+static guint myfiles_version = 0;
+static gchar *staging_dir = NULL;
+static uint64_t staging_memory = 16 * 1024 * 1024;
+static uint64_t staging_size = 1024 * 1024 * 1024;
+static GHashTable *staged_files = NULL;
+static uint64_t staged_bytes = 0;
+static uint64_t staged_memory_bytes = 0;
+static uint64_t staged_peak = 0;
+static gboolean staging_full = FALSE;
+static GMutex staging_lock;
+static GCond staging_cond;
+static uint64_t queued_bytes = 0;
+static GThreadPool *upload_preparer = NULL;
+static GAsyncQueue *upload_queue = NULL;
+static QueuedUpload upload_queue_end;
+static GThread *uploader = NULL;
+static GHashTable *queued_uploads = NULL;
+static GMutex upload_queue_lock;
+static GCond upload_queue_cond;
+static Snapshot *current_snapshot = NULL;
+static Snapshot *current_pending = NULL;
+static GMutex snapshot_lock;
+static guint published_index_version = 0;
+static guint published_myfiles_version = 0;
+static guint published_playlists = 0;
+static gint64 published_at = 0;
+static GThread *index_walker = NULL;
+static gint index_walker_stop = 0;
+static gboolean partial_reads = TRUE;
+static gboolean partial_reads_64 = FALSE;
+static gboolean edit_objects = TRUE;
+static gchar *content_cache_dir = NULL;
+static guint64 content_cache_size = 256 * 1024 * 1024;
+static GHashTable *downloads = NULL;
+static GMutex download_lock;
+static GCond download_cond;
+static guint downloads_running = 0;
+static gboolean downloads_stop = FALSE;
+static GHashTable *chunk_cache = NULL;
+static GQueue chunk_lru = G_QUEUE_INIT;
+static GHashTable *pending_chunks = NULL;
+static GThreadPool *readahead_pool = NULL;
+static gint readahead_stop = 0;
 
 #endif /* _MTPFS_H_ */